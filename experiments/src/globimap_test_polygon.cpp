@@ -123,9 +123,9 @@ std::string test_polys(globimap::CountingGloBiMap<> &g,
     auto raster = rasterize_polygon(p);
     // std::cout << n << " -> " << raster.size() << " : " << std::endl;
     if (raster.size() > 0) {
-      auto hsfn = g.to_hashfn(raster);
+      globimap::HashedRaster hsfn(raster);
       auto res_raster = g.get_sum_raster_collected(raster);
-      auto res_hashfn = g.get_sum_hashfn(raster);
+      auto res_hashfn = g.get_sum(hsfn);
       uint64_t err = std::abs((int64_t)res_hashfn - (int64_t)res_raster);
       // std::cout << res_raster << "  :" << res_hashfn << " : " << err << " : "
       //           << raster.size() / 2 << std::endl;
@@ -115,7 +115,7 @@ test_polys_mask(globimap::CountingGloBiMap<> &g, size_t poly_size,
     auto raster = poly_gen(idx);
 
     if (raster.size() > 0) {
-      auto hsfn = g.to_hashfn(raster);
+      globimap::HashedRaster hsfn(raster);
 
       auto mask_conf = globimap::FilterConfig{
           g.config.hash_k, {{1, g.config.layers[0].logsize}}};
@@ -124,7 +124,7 @@ test_polys_mask(globimap::CountingGloBiMap<> &g, size_t poly_size,
 
       auto res_raster = g.get_sum_raster_collected(raster);
       auto res_mask = g.get_sum_masked(mask);
-      auto res_hashfn = g.get_sum_hashfn(raster);
+      auto res_hashfn = g.get_sum(hsfn);
 
       sums.push_back(res_raster);
       sums_mask.push_back(res_mask);
@@ -0,0 +1,188 @@
+/*
+Packed bit storage for the GloBiMap filter and the 1 bit layers of
+CountingGloBiMap
+
+One filter bit is stored as one bit of a 64-bit word. Bit k lives in word
+k >> 6 at position k & 63, so on little-endian machines the word array has
+exactly the byte layout produced by GloBiMap::tobuffer (bit k is bit k % 8 of
+byte k / 8) and (de)serialization reduces to a memcpy.
+
+class Bitset:
+    void resize(size_t n)
+        resize to n bits, new bits are zero
+    bool test(uint64_t k) / void set(uint64_t k)
+        read / set bit k; f[k] reads bit k, on a non-const Bitset it can be
+        assigned like an element of std::vector<bool> (not thread-safe)
+    bool set_atomic(uint64_t k)
+        set bit k with an atomic fetch-or on its word (thread-safe), true if
+        this call set it. A set bit is seen by a relaxed load first and costs
+        no read-modify-write.
+    void prefetch(uint64_t k)
+        software prefetch of the word holding bit k
+    void shrink_to_fit()
+        release the owned words beyond size()
+    size_t count()
+        number of ones (popcount over words, OMP parallel)
+    void to_bytes(std::string &buf) / from_bytes(buf, buf_size, n)
+        byte serialization compatible with GloBiMap::tobuffer
+    void attach(std::shared_ptr<void> owner, word_t *w, size_t n)
+        use n bits at w (e.g. a file mapping kept alive by owner) instead of
+        owned words. Copies and resize copy the bits into owned memory.
+*/
+#ifndef BITSET_HPP
+#define BITSET_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <string.h>
+
+namespace globimap {
+
+class Bitset {
+public:
+  typedef uint64_t word_t;
+  static const size_t word_bits = 64;
+
+private:
+  std::vector<word_t> words;
+  std::shared_ptr<void> owner; ///< keeps attached (external) words alive
+  word_t *w = nullptr;         ///< words.data() or the attached words
+  size_t nwords = 0;
+  size_t nbits = 0;
+
+  // take over the attached words into owned memory
+  void detach() {
+    if (!owner)
+      return;
+    words.assign(w, w + nwords);
+    owner.reset();
+    w = words.data();
+  }
+
+public:
+  Bitset() = default;
+  // copies own their words, also when o is attached
+  Bitset(const Bitset &o)
+      : words(o.w, o.w + o.nwords), w(words.data()), nwords(o.nwords),
+        nbits(o.nbits) {}
+  Bitset(Bitset &&o) noexcept
+      : words(std::move(o.words)), owner(std::move(o.owner)), w(o.w),
+        nwords(o.nwords), nbits(o.nbits) {
+    o.w = nullptr;
+    o.nwords = o.nbits = 0;
+  }
+  Bitset &operator=(Bitset o) noexcept {
+    words.swap(o.words);
+    owner.swap(o.owner);
+    std::swap(w, o.w);
+    std::swap(nwords, o.nwords);
+    std::swap(nbits, o.nbits);
+    return *this;
+  }
+
+  size_t size() const { return nbits; }
+  size_t word_count() const { return nwords; }
+  size_t byte_size() const { return nwords * sizeof(word_t); }
+  word_t *data() { return w; }
+  const word_t *data() const { return w; }
+  bool attached() const { return owner != nullptr; }
+
+  void attach(std::shared_ptr<void> _owner, word_t *_w, size_t n) {
+    clear();
+    owner = std::move(_owner);
+    w = _w;
+    nwords = (n + word_bits - 1) / word_bits;
+    nbits = n;
+  }
+
+  void clear() {
+    words.clear();
+    words.shrink_to_fit();
+    owner.reset();
+    w = nullptr;
+    nwords = nbits = 0;
+  }
+
+  void resize(size_t n) {
+    detach();
+    words.resize((n + word_bits - 1) / word_bits, 0);
+    w = words.data();
+    nwords = words.size();
+    nbits = n;
+    // bits beyond the end of a shrunk set must not survive a later grow
+    if (n % word_bits != 0)
+      words.back() &= (static_cast<word_t>(1) << (n % word_bits)) - 1;
+  }
+
+  // a bit of a non-const Bitset, as std::vector<bool>::reference
+  class reference {
+    word_t *word;
+    word_t bit;
+
+  public:
+    reference(word_t *word, word_t bit) : word(word), bit(bit) {}
+    operator bool() const { return (*word & bit) != 0; }
+    reference &operator=(bool v) {
+      *word = v ? *word | bit : *word & ~bit;
+      return *this;
+    }
+    reference &operator=(const reference &o) {
+      return *this = static_cast<bool>(o);
+    }
+  };
+
+  bool test(uint64_t k) const { return (w[k >> 6] >> (k & 63)) & 1; }
+  bool operator[](uint64_t k) const { return test(k); }
+  reference operator[](uint64_t k) {
+    return reference(&w[k >> 6], static_cast<word_t>(1) << (k & 63));
+  }
+  void set(uint64_t k) { w[k >> 6] |= static_cast<word_t>(1) << (k & 63); }
+  // lock-free, setting a bit is idempotent so relaxed ordering is sufficient
+  bool set_atomic(uint64_t k) {
+    word_t bit = static_cast<word_t>(1) << (k & 63);
+    if (__atomic_load_n(&w[k >> 6], __ATOMIC_RELAXED) & bit)
+      return false;
+    return !(__atomic_fetch_or(&w[k >> 6], bit, __ATOMIC_RELAXED) & bit);
+  }
+
+  void prefetch(uint64_t k) const { __builtin_prefetch(&w[k >> 6]); }
+
+  void shrink_to_fit() {
+    if (owner)
+      return;
+    words.resize(nwords);
+    words.shrink_to_fit();
+    w = words.data();
+  }
+
+  size_t count() const {
+    size_t ones = 0;
+#pragma omp parallel for reduction(+ : ones)
+    for (size_t i = 0; i < nwords; i++)
+      ones += __builtin_popcountll(w[i]);
+    return ones;
+  }
+
+  void to_bytes(std::string &buf) const {
+    buf.resize((nbits + 7) / 8);
+    if (buf.size() > 0)
+      memcpy(&buf[0], w, buf.size());
+  }
+
+  void from_bytes(const unsigned char *buf, size_t buf_size, size_t n) {
+    clear();
+    resize(n);
+    size_t bytes = std::min(buf_size, (n + 7) / 8);
+    if (bytes > 0)
+      memcpy(w, buf, bytes);
+    resize(n); // mask the trailing bits of the last byte
+  }
+};
+
+} // namespace globimap
+
+#endif
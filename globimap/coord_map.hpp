@@ -0,0 +1,169 @@
+/*
+A flat open-addressing hash map from pixels to non-zero 32 bit counts, the
+ground truth (collected input) and error store of CountingGloBiMap
+
+Keys are the packed coordinates (x << 32 | y). Slots are two flat arrays,
+keys and values, probed linearly from a mixed hash of the key; a zero value
+marks an empty slot, so a count is never 0. The table doubles when it is half
+full; erase shifts the following entries of the probe chain back into the
+hole, so lookups never need tombstones. Counts saturate at UINT32_MAX.
+Lookups (get, contains, for_each) do not modify the table and may run
+concurrently from parallel loops; set, add and erase must not run
+concurrently with anything else.
+
+class CoordMap:
+    void add(uint64_t k, uint64_t v)
+        count k up by v, inserting it with v if it is not there
+    void set(uint64_t k, uint64_t v)
+        insert or overwrite, set(k, 0) erases k
+    void erase(uint64_t k)
+        remove k if it is there
+    uint32_t get(uint64_t k)
+        the count of k, 0 if it is not there
+    void for_each(f)
+        call f(k, v) for every entry, in no particular order
+*/
+#ifndef COORD_MAP_HPP
+#define COORD_MAP_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace globimap {
+
+class CoordMap {
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> values; ///< 0 marks an empty slot
+  uint64_t mask = 0;
+  size_t used = 0;
+
+  static uint64_t mix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+  }
+
+  // the slot of k, or the empty slot where it would go
+  size_t slot(uint64_t k) const {
+    size_t i = mix(k) & mask;
+    while (values[i] != 0 && keys[i] != k)
+      i = (i + 1) & mask;
+    return i;
+  }
+
+  void rehash(size_t slots) {
+    std::vector<uint64_t> old_keys(slots);
+    std::vector<uint32_t> old_values(slots);
+    old_keys.swap(keys);
+    old_values.swap(values);
+    mask = slots - 1;
+    for (size_t i = 0; i < old_values.size(); i++)
+      if (old_values[i] != 0) {
+        size_t j = slot(old_keys[i]);
+        keys[j] = old_keys[i];
+        values[j] = old_values[i];
+      }
+  }
+
+  static uint32_t saturate(uint64_t v) {
+    return static_cast<uint32_t>(std::min<uint64_t>(v, UINT32_MAX));
+  }
+
+  // the slot of k after making room for one more entry
+  size_t claim(uint64_t k) {
+    if (2 * (used + 1) > values.size())
+      rehash(values.empty() ? 16 : 2 * values.size());
+    size_t i = slot(k);
+    if (values[i] == 0) {
+      keys[i] = k;
+      used++;
+    }
+    return i;
+  }
+
+public:
+  static uint64_t key(uint32_t x, uint32_t y) {
+    return (static_cast<uint64_t>(x) << 32) | y;
+  }
+  static uint32_t key_x(uint64_t k) { return static_cast<uint32_t>(k >> 32); }
+  static uint32_t key_y(uint64_t k) { return static_cast<uint32_t>(k); }
+
+  size_t size() const { return used; }
+  bool empty() const { return used == 0; }
+  size_t byte_size() const {
+    return keys.size() * sizeof(uint64_t) + values.size() * sizeof(uint32_t);
+  }
+
+  void clear() {
+    keys.clear();
+    keys.shrink_to_fit();
+    values.clear();
+    values.shrink_to_fit();
+    mask = 0;
+    used = 0;
+  }
+
+  // room for n entries without rehashing
+  void reserve(size_t n) {
+    size_t slots = 16;
+    while (slots < 2 * n)
+      slots *= 2;
+    if (slots > values.size())
+      rehash(slots);
+  }
+
+  void add(uint64_t k, uint64_t v) {
+    if (v == 0)
+      return;
+    size_t i = claim(k);
+    values[i] = saturate(values[i] + std::min<uint64_t>(v, UINT32_MAX));
+  }
+  void set(uint64_t k, uint64_t v) {
+    if (v == 0)
+      erase(k);
+    else
+      values[claim(k)] = saturate(v);
+  }
+
+  void erase(uint64_t k) {
+    if (used == 0)
+      return;
+    size_t i = slot(k);
+    if (values[i] == 0)
+      return;
+    // move an entry j of the chain after the hole i into it unless its home
+    // slot lies cyclically in (i, j]
+    for (size_t j = (i + 1) & mask; values[j] != 0; j = (j + 1) & mask) {
+      size_t home = mix(keys[j]) & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        keys[i] = keys[j];
+        values[i] = values[j];
+        i = j;
+      }
+    }
+    values[i] = 0;
+    used--;
+  }
+
+  uint32_t get(uint64_t k) const {
+    if (used == 0)
+      return 0;
+    return values[slot(k)];
+  }
+  bool contains(uint64_t k) const { return get(k) != 0; }
+
+  template <typename F> void for_each(F f) const {
+    for (size_t i = 0; i < values.size(); i++)
+      if (values[i] != 0)
+        f(keys[i], values[i]);
+  }
+};
+
+} // namespace globimap
+
+#endif
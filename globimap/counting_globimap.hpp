@@ -1,6 +1,11 @@
-#ifndef GLOBIMAP_HPP_INC
-#define GLOBIMAP_HPP_INC
+#ifndef COUNTING_GLOBIMAP_HPP_INC
+#define COUNTING_GLOBIMAP_HPP_INC
+#include "bitset.hpp"
+#include "coord_map.hpp"
+#include "external_counter.hpp"
 #include "hashfn.hpp"
+#include "morton.hpp"
+#include "quantile_sketch.hpp"
 #include <algorithm>
 #include <cassert>
 #include <climits>
@@ -9,11 +14,19 @@
 #include <limits>
 #include <list>
 #include <map>
+#include <memory>
+#include <optional>
 #include <set>
 #include <sstream>
+#include <stdexcept>
+#include <type_traits>
 #include <unordered_set>
 #include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #define THRESHOLD_1BIT 1
 #define THRESHOLD_8BIT 0xff
 #define THRESHOLD_16BIT 0xffff
@@ -39,32 +52,24 @@
 #endif
 
 namespace globimap {
+static const uint64_t H1 = 8589845122, H2 = 8465418721;
+
+// Saturating atomic increment of counter k, returns the new value or 0 (and
+// no change) if it is at threshold already. A 1 bit counter is set with an
+// atomic fetch-or on its word, the old word tells which thread set it.
 template <typename T>
-static std::vector<double> make_histogram(std::vector<T> &values,
-                                          const uint size = 1024) {
-  std::sort(values.begin(), values.end());
-  uint bucket_size = values.size() / size;
-  uint rest = values.size() % size;
-  uint step = size / rest;
-  std::vector<double> res({0});
-  res.resize(size);
-
-  auto off = 0;
-  for (auto i = 0; i < size; ++i) {
-    double bucket = 0;
-    uint b = bucket_size;
-    for (auto x = 0; x < b; x++) {
-      bucket += values[off + x];
-    }
-    off += b;
-    if (bucket != 0)
-      bucket /= (double)b;
-    res[i] = bucket;
-  }
-  return res;
+inline uint64_t increment_saturating(std::vector<T> &f, size_t k,
+                                     T threshold) {
+  T v = __atomic_load_n(&f[k], __ATOMIC_RELAXED);
+  while (v != threshold)
+    if (__atomic_compare_exchange_n(&f[k], &v, static_cast<T>(v + 1), true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return static_cast<uint64_t>(v) + 1;
+  return 0;
+}
+inline uint64_t increment_saturating(Bitset &f, size_t k, bool) {
+  return f.set_atomic(k);
 }
-
-static const uint64_t H1 = 8589845122, H2 = 8465418721;
 
 template <typename BITS1 = bool, typename BITS8 = uint8_t,
           typename BITS16 = uint16_t, typename BITS32 = uint32_t,
@@ -74,7 +79,7 @@ struct Layer {
   uint bits;
   uint64_t size;
   uint64_t mask;
-  std::vector<BITS1> f1;
+  Bitset f1; ///< 1 bit counters packed into words, read as BITS1
   std::vector<BITS8> f8;
   std::vector<BITS16> f16;
   std::vector<BITS32> f32;
@@ -102,97 +107,77 @@ struct Layer {
       assert(false); // bits needs to be 1,8,16,32 or 64
     }
   }
-  template <typename T> T get(size_t i) const {
+  // Call f(counters, threshold) with the typed counter vector of this layer
+  // and its saturation value: one dispatch on bits for a whole loop instead
+  // of one per counter access.
+  template <typename F> void visit(F f) {
     switch (bits) {
     case 1:
-      return static_cast<T>(f1[i]);
+      f(f1, static_cast<BITS1>(THRESHOLD_1BIT));
       break;
     case 8:
-      return static_cast<T>(f8[i]);
+      f(f8, static_cast<BITS8>(THRESHOLD_8BIT));
       break;
     case 16:
-      return static_cast<T>(f16[i]);
+      f(f16, static_cast<BITS16>(THRESHOLD_16BIT));
       break;
     case 32:
-      return static_cast<T>(f32[i]);
+      f(f32, static_cast<BITS32>(THRESHOLD_32BIT));
       break;
     case 64:
-      return static_cast<T>(f64[i]);
+      f(f64, static_cast<BITS64>(THRESHOLD_64BIT));
       break;
     default:
       assert(false); // bits needs to be 1,8,16,32 or 64
     }
-    return 1;
   }
-
-  template <typename T> T put(size_t i, T value) {
+  template <typename F> void visit(F f) const {
     switch (bits) {
     case 1:
-      f1[i] = static_cast<BITS1>(value);
+      f(f1, static_cast<BITS1>(THRESHOLD_1BIT));
       break;
     case 8:
-      f8[i] = static_cast<BITS8>(value);
+      f(f8, static_cast<BITS8>(THRESHOLD_8BIT));
       break;
     case 16:
-      f16[i] = static_cast<BITS16>(value);
+      f(f16, static_cast<BITS16>(THRESHOLD_16BIT));
       break;
     case 32:
-      f32[i] = static_cast<BITS32>(value);
+      f(f32, static_cast<BITS32>(THRESHOLD_32BIT));
       break;
     case 64:
-      f64[i] = static_cast<BITS64>(value);
+      f(f64, static_cast<BITS64>(THRESHOLD_64BIT));
       break;
     default:
       assert(false); // bits needs to be 1,8,16,32 or 64
     }
   }
-  void increment(size_t i) {
-    switch (bits) {
-    case 1:
-      f1[i] = true;
-      break;
-    case 8:
-      f8[i]++;
-      break;
-    case 16:
-      f16[i]++;
-      break;
-    case 32:
-      f32[i]++;
-      break;
-    case 64:
-      f64[i]++;
-      break;
-    default:
-      assert(false); // bits needs to be 1,8,16,32 or 64
-    }
-  }
-  bool threshold(size_t i) {
+
+  void prefetch(size_t i) const {
     switch (bits) {
     case 1:
-      return f1[i] == THRESHOLD_1BIT;
+      f1.prefetch(i);
       break;
     case 8:
-      return f8[i] == THRESHOLD_8BIT;
+      __builtin_prefetch(&f8[i]);
       break;
     case 16:
-      return f16[i] == THRESHOLD_16BIT;
+      __builtin_prefetch(&f16[i]);
       break;
     case 32:
-      return f32[i] == THRESHOLD_32BIT;
+      __builtin_prefetch(&f32[i]);
       break;
     case 64:
-      return f64[i] == THRESHOLD_64BIT;
+      __builtin_prefetch(&f64[i]);
       break;
     default:
       assert(false); // bits needs to be 1,8,16,32 or 64
-      return false;
     }
   }
   uint64_t byte_size() {
     switch (bits) {
     case 1:
-      return f1.size() / 8;
+      return f1.byte_size();
       break;
     case 8:
       return f8.size();
@@ -260,75 +245,63 @@ struct Layer {
     uint64_t zeros, min, max, sum;
   };
 
-  Stats stats() {
-    Stats s = {0};
-    s.min = ULLONG_MAX;
-
-    switch (bits) {
-    case 1: {
-#pragma omp parallel for
-      for (size_t i = 0; i < f1.size(); i++) {
-        PARA_ATOMIC
-        s.sum += f1[i];
-        s.min = std::min(s.min, (uint64_t)f1[i]);
-        s.max = std::max(s.max, (uint64_t)f1[i]);
-        if (f1[i] == 0)
-          s.zeros++;
-      }
-    } break;
-    case 8: {
-#pragma omp parallel for
-      for (size_t i = 0; i < f8.size(); i++) {
-        PARA_ATOMIC
-        s.sum += f8[i];
-        s.min = std::min(s.min, (uint64_t)f8[i]);
-        s.max = std::max(s.max, (uint64_t)f8[i]);
-        if (f8[i] == 0)
-          s.zeros++;
-      }
-    } break;
-    case 16: {
-#pragma omp parallel for
-      for (size_t i = 0; i < f16.size(); i++) {
-        PARA_ATOMIC
-        s.sum += f16[i];
-        s.min = std::min(s.min, (uint64_t)f16[i]);
-        s.max = std::max(s.max, (uint64_t)f16[i]);
-        if (f16[i] == 0)
-          s.zeros++;
-      }
-    } break;
-    case 32: {
-#pragma omp parallel for
-      for (size_t i = 0; i < f32.size(); i++) {
-        PARA_ATOMIC
-        s.sum += f32[i];
-        s.min = std::min(s.min, (uint64_t)f32[i]);
-        s.max = std::max(s.max, (uint64_t)f32[i]);
-        if (f32[i] == 0)
-          s.zeros++;
-      }
-    } break;
-    case 64: {
-#pragma omp parallel for
-      for (size_t i = 0; i < f64.size(); i++) {
-        PARA_ATOMIC
-        s.sum += f64[i];
-        s.min = std::min(s.min, (uint64_t)f64[i]);
-        s.max = std::max(s.max, (uint64_t)f64[i]);
-        if (f64[i] == 0)
-          s.zeros++;
+  // Full scan: an OMP/SIMD reduction over the counters, a popcount over the
+  // words for 1 bit layers.
+  Stats stats() const {
+    Stats s = {0, ULLONG_MAX, 0, 0};
+    visit([&](const auto &f, auto) {
+      if constexpr (std::is_same<std::decay_t<decltype(f)>, Bitset>::value) {
+        s.sum = f.count();
+        s.zeros = f.size() - s.sum;
+        s.max = s.sum > 0;
+        if (f.size() > 0)
+          s.min = s.zeros == 0;
+      } else {
+        uint64_t zeros = 0, sum = 0, min_v = ULLONG_MAX, max_v = 0;
+        const auto *d = f.data();
+        size_t n = f.size();
+#pragma omp parallel for simd reduction(+ : zeros, sum) \
+    reduction(min : min_v) reduction(max : max_v)
+        for (size_t i = 0; i < n; i++) {
+          uint64_t v = d[i];
+          zeros += v == 0;
+          sum += v;
+          min_v = std::min(min_v, v);
+          max_v = std::max(max_v, v);
+        }
+        s = {zeros, min_v, max_v, sum};
       }
-    } break;
-    default:
-      assert(false); // bits needs to be 1,8,16,32 or 64
-    }
+    });
     return s;
   }
 
-  std::string summary() {
+  // Statistics maintained by the put kernels of a CountingGloBiMap with
+  // track_stats (zeros, sum, max; min is 0 while there are zeros).
+  Stats tracked = {0, 0, 0, 0};
+  // filled counters went from zero to one, added increments in total
+  void track(uint64_t filled, uint64_t added, uint64_t max_v) {
+    tracked.zeros -= filled;
+    tracked.sum += added;
+    tracked.max = std::max(tracked.max, max_v);
+  }
+  void track_atomic(uint64_t filled, uint64_t added, uint64_t max_v) {
+    __atomic_fetch_sub(&tracked.zeros, filled, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tracked.sum, added, __ATOMIC_RELAXED);
+    uint64_t m = __atomic_load_n(&tracked.max, __ATOMIC_RELAXED);
+    while (m < max_v && !__atomic_compare_exchange_n(&tracked.max, &m, max_v,
+                                                     true, __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED))
+      ;
+  }
+  Stats tracked_stats() const {
+    Stats s = tracked;
+    s.min = s.zeros > 0 ? 0 : stats().min; // a full layer needs a scan
+    return s;
+  }
+
+  std::string summary(bool use_tracked = false) {
 
-    auto s = stats();
+    auto s = use_tracked ? tracked_stats() : stats();
 
     std::stringstream ss;
     ss << "{" << std::endl;
@@ -369,6 +342,314 @@ struct FilterConfig {
     return ss.str();
   }
 };
+/***
+ * Probe kernels specialized at compile time for a fixed hash count K and
+ * fixed layer bit depths (e.g. FixedKernels<8, 8, 16, 32>). The probe loop is
+ * unrolled and every layer access is typed, there is no switch (bits) left in
+ * the loop. A kernel works on n hash pairs hs[2j], hs[2j+1] and has the same
+ * semantics as the runtime loops of CountingGloBiMap.
+ ***/
+template <uint B> struct LayerBits;
+template <> struct LayerBits<1> {
+  template <typename L> static auto &v(L &l) { return l.f1; }
+  static const uint64_t threshold = THRESHOLD_1BIT;
+};
+template <> struct LayerBits<8> {
+  template <typename L> static auto &v(L &l) { return l.f8; }
+  static const uint64_t threshold = THRESHOLD_8BIT;
+};
+template <> struct LayerBits<16> {
+  template <typename L> static auto &v(L &l) { return l.f16; }
+  static const uint64_t threshold = THRESHOLD_16BIT;
+};
+template <> struct LayerBits<32> {
+  template <typename L> static auto &v(L &l) { return l.f32; }
+  static const uint64_t threshold = THRESHOLD_32BIT;
+};
+template <> struct LayerBits<64> {
+  template <typename L> static auto &v(L &l) { return l.f64; }
+  static const uint64_t threshold = THRESHOLD_64BIT;
+};
+
+// pixels [x, x + width) x [y, y + height)
+struct Region {
+  uint64_t x, y, width, height;
+};
+
+template <size_t K, uint... Bits> struct FixedKernels {
+  static bool matches(const FilterConfig &conf) {
+    const uint bits[] = {Bits...};
+    if (conf.hash_k != K || conf.layers.size() != sizeof...(Bits))
+      return false;
+    for (size_t i = 0; i < sizeof...(Bits); i++)
+      if (conf.layers[i].bits != bits[i])
+        return false;
+    return true;
+  }
+
+  // increment the first layer below its threshold
+  template <typename M, size_t L, uint B, uint... Rest>
+  static void put_layer(M &m, uint64_t h) {
+    auto &l = m.layers[L];
+    auto &f = LayerBits<B>::v(l);
+    uint64_t k = h & l.mask;
+    if (f[k] != LayerBits<B>::threshold) {
+      f[k] = f[k] + 1;
+      return;
+    }
+    if constexpr (sizeof...(Rest) > 0)
+      put_layer<M, L + 1, Rest...>(m, h);
+  }
+
+  // sum the counters up to the first layer below its threshold, false if a
+  // visited counter is zero
+  template <typename M, size_t L, uint B, uint... Rest>
+  static bool get_layer(const M &m, uint64_t h, uint64_t &sum) {
+    const auto &l = m.layers[L];
+    uint64_t v = LayerBits<B>::v(l)[h & l.mask];
+    if (v == 0)
+      return false;
+    sum += v;
+    if constexpr (sizeof...(Rest) > 0) {
+      if (v == LayerBits<B>::threshold)
+        return get_layer<M, L + 1, Rest...>(m, h, sum);
+    }
+    return true;
+  }
+
+  template <typename M> static void put(M &m, const uint64_t *hs, size_t n) {
+    for (size_t j = 0; j < n; j++)
+      for (size_t i = 0; i < K; i++)
+        put_layer<M, 0, Bits...>(m, hs[2 * j] + (i + 1) * hs[2 * j + 1]);
+  }
+
+  template <typename M>
+  static void get_min(const M &m, const uint64_t *hs, size_t n,
+                      uint64_t *out) {
+    for (size_t j = 0; j < n; j++) {
+      uint64_t min_v = UINT64_MAX;
+      for (size_t i = 0; i < K; i++) {
+        uint64_t sum = 0;
+        if (!get_layer<M, 0, Bits...>(m, hs[2 * j] + (i + 1) * hs[2 * j + 1],
+                                      sum)) {
+          min_v = 0;
+          break;
+        }
+        min_v = std::min(min_v, sum);
+      }
+      out[j] = min_v;
+    }
+  }
+};
+
+template <typename... FK> struct KernelList {};
+
+// The configurations precompiled into CountingGloBiMap: hash count 8 with
+// the bit depths of the experiments. Define GLOBIMAP_FIXED_KERNELS before
+// including this header to compile a different set.
+#ifndef GLOBIMAP_FIXED_KERNELS
+#define GLOBIMAP_FIXED_KERNELS                                                 \
+  FixedKernels<8, 8>, FixedKernels<8, 16>, FixedKernels<8, 32>,                \
+      FixedKernels<8, 8, 16>, FixedKernels<8, 8, 32>, FixedKernels<8, 16, 32>, \
+      FixedKernels<8, 8, 16, 32>, FixedKernels<8, 1, 8>,                       \
+      FixedKernels<8, 1, 8, 16>, FixedKernels<8, 1, 8, 32>,                    \
+      FixedKernels<8, 1, 16, 32>
+#endif
+typedef KernelList<GLOBIMAP_FIXED_KERNELS> fixed_kernels_t;
+
+/***
+ * Layer 0 minimum of n hash pairs: out[j] = min over the k probes
+ * hs[2j] + (i+1) hs[2j+1] of the counters c[probe & mask], and if out_max is
+ * given the maximum in out_max[j] (only meaningful if out[j] != 0). This is
+ * the whole answer of get_min unless a probe of the pixel is saturated (see
+ * CountingGloBiMap::get_min_many_hs). The 8, 16 and 32 bit layers use
+ * AVX-512 (8 pixels) or AVX2 (4 pixels) gathers of aligned 32 bit words, the
+ * counter is shifted out of the word afterwards.
+ ***/
+template <typename V>
+inline void probe_min(const V &c, uint64_t mask, uint64_t k,
+                      const uint64_t *hs, size_t n, uint64_t *out,
+                      uint64_t *out_max = nullptr) {
+  for (size_t j = 0; j < n; j++) {
+    uint64_t p = hs[2 * j], min_v = UINT64_MAX, max_v = 0;
+    for (uint64_t i = 0; i < k && min_v != 0; i++) {
+      p += hs[2 * j + 1];
+      uint64_t v = static_cast<uint64_t>(c[p & mask]);
+      min_v = std::min(min_v, v);
+      max_v = std::max(max_v, v);
+    }
+    out[j] = min_v;
+    if (out_max)
+      out_max[j] = max_v;
+  }
+}
+
+#if (defined(__AVX512F__) && defined(__AVX512DQ__)) || defined(__AVX2__)
+template <typename T>
+inline void probe_min_simd(const std::vector<T> &c, uint64_t mask,
+                           uint64_t k, const uint64_t *hs, size_t n,
+                           uint64_t *out, uint64_t *out_max) {
+  static_assert(sizeof(T) <= 4, "gathers of 32 bit words");
+  const char *base = reinterpret_cast<const char *>(c.data());
+  const int value_mask =
+      static_cast<int>((static_cast<uint64_t>(1) << (8 * sizeof(T))) - 1);
+  size_t j = 0;
+  // the gathered words must not reach beyond the counters
+  const size_t simd_n = c.size() * sizeof(T) % 4 == 0 ? n : 0;
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+  const __m512i vmask = _mm512_set1_epi64(mask);
+  const __m512i lanes = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+  for (; j + 8 <= simd_n; j += 8) {
+    __m512i p = _mm512_i64gather_epi64(lanes, hs + 2 * j, 8);
+    __m512i h2 = _mm512_i64gather_epi64(lanes, hs + 2 * j + 1, 8);
+    __m256i min_v = _mm256_set1_epi32(-1), max_v = _mm256_setzero_si256();
+    for (uint64_t i = 0; i < k; i++) {
+      p = _mm512_add_epi64(p, h2);
+      __m512i off = _mm512_slli_epi64(_mm512_and_si512(p, vmask),
+                                      __builtin_ctz(sizeof(T)));
+      __m512i word = _mm512_andnot_si512(_mm512_set1_epi64(3), off);
+      __m256i shift = _mm512_cvtepi64_epi32(
+          _mm512_slli_epi64(_mm512_and_si512(off, _mm512_set1_epi64(3)), 3));
+      __m256i v = _mm512_i64gather_epi32(word, base, 1);
+      v = _mm256_and_si256(_mm256_srlv_epi32(v, shift),
+                           _mm256_set1_epi32(value_mask));
+      min_v = _mm256_min_epu32(min_v, v);
+      max_v = _mm256_max_epu32(max_v, v);
+    }
+    alignas(32) uint32_t m[8], x[8];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(m), min_v);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(x), max_v);
+    for (size_t l = 0; l < 8; l++)
+      out[j + l] = m[l];
+    if (out_max)
+      for (size_t l = 0; l < 8; l++)
+        out_max[j + l] = x[l];
+  }
+#else
+  const __m256i vmask = _mm256_set1_epi64x(mask);
+  const __m256i lanes = _mm256_set_epi64x(6, 4, 2, 0);
+  const __m256i low32 = _mm256_set_epi32(7, 5, 3, 1, 6, 4, 2, 0);
+  for (; j + 4 <= simd_n; j += 4) {
+    const long long *h = reinterpret_cast<const long long *>(hs + 2 * j);
+    __m256i p = _mm256_i64gather_epi64(h, lanes, 8);
+    __m256i h2 = _mm256_i64gather_epi64(h + 1, lanes, 8);
+    __m128i min_v = _mm_set1_epi32(-1), max_v = _mm_setzero_si128();
+    for (uint64_t i = 0; i < k; i++) {
+      p = _mm256_add_epi64(p, h2);
+      __m256i off = _mm256_slli_epi64(_mm256_and_si256(p, vmask),
+                                      __builtin_ctz(sizeof(T)));
+      __m256i word = _mm256_andnot_si256(_mm256_set1_epi64x(3), off);
+      __m128i shift = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+          _mm256_slli_epi64(_mm256_and_si256(off, _mm256_set1_epi64x(3)), 3),
+          low32));
+      __m128i v = _mm256_i64gather_epi32(reinterpret_cast<const int *>(base),
+                                         word, 1);
+      v = _mm_and_si128(_mm_srlv_epi32(v, shift), _mm_set1_epi32(value_mask));
+      min_v = _mm_min_epu32(min_v, v);
+      max_v = _mm_max_epu32(max_v, v);
+    }
+    alignas(16) uint32_t m[4], x[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(m), min_v);
+    _mm_store_si128(reinterpret_cast<__m128i *>(x), max_v);
+    for (size_t l = 0; l < 4; l++)
+      out[j + l] = m[l];
+    if (out_max)
+      for (size_t l = 0; l < 4; l++)
+        out_max[j + l] = x[l];
+  }
+#endif
+  probe_min(c, mask, k, hs + 2 * j, n - j, out + j,
+            out_max ? out_max + j : nullptr);
+}
+
+inline void probe_min(const std::vector<uint8_t> &c, uint64_t mask,
+                      uint64_t k, const uint64_t *hs, size_t n,
+                      uint64_t *out, uint64_t *out_max = nullptr) {
+  probe_min_simd(c, mask, k, hs, n, out, out_max);
+}
+inline void probe_min(const std::vector<uint16_t> &c, uint64_t mask,
+                      uint64_t k, const uint64_t *hs, size_t n,
+                      uint64_t *out, uint64_t *out_max = nullptr) {
+  probe_min_simd(c, mask, k, hs, n, out, out_max);
+}
+inline void probe_min(const std::vector<uint32_t> &c, uint64_t mask,
+                      uint64_t k, const uint64_t *hs, size_t n,
+                      uint64_t *out, uint64_t *out_max = nullptr) {
+  probe_min_simd(c, mask, k, hs, n, out, out_max);
+}
+#endif
+
+/***
+ * A pixel list hashed once, the input of get_sum / get_min_many for any
+ * number of CountingGloBiMaps (they all hash with the seed H1). A probe
+ * (h1 + (i+1) h2) & mask only reads the low bits of h1 and h2, so the pairs
+ * keep hash_bits (32 or 64) low bits each: 8 bytes per pixel, half of the
+ * coordinates, for maps whose layers have at most 2^32 counters (the
+ * default), 16 bytes for larger layers. Maps with larger layers reject a 32
+ * bit raster. Hashing runs OMP parallel.
+ ***/
+class HashedRaster {
+  std::vector<uint64_t> wide;   ///< h1 of pixel j at 2j, h2 at 2j+1
+  std::vector<uint32_t> narrow; ///< the same, low 32 bits
+  size_t n = 0;
+  uint32_t bits = 32;
+  uint64_t hash_seed = H1;
+
+public:
+  HashedRaster() = default;
+  // points: the pixel coordinates x0, y0, x1, y1, ...
+  explicit HashedRaster(const std::vector<uint64_t> &points,
+                        uint64_t seed = H1, uint32_t hash_bits = 32) {
+    assign(points.data(), points.size() / 2, seed, hash_bits);
+  }
+  HashedRaster(const uint64_t *points, size_t n, uint64_t seed = H1,
+               uint32_t hash_bits = 32) {
+    assign(points, n, seed, hash_bits);
+  }
+
+  void assign(const uint64_t *points, size_t count, uint64_t seed = H1,
+              uint32_t hash_bits = 32) {
+    if (hash_bits != 32 && hash_bits != 64)
+      throw(std::runtime_error("hash_bits must be 32 or 64"));
+    const size_t chunk = 1024;
+    n = count;
+    bits = hash_bits;
+    hash_seed = seed;
+    wide.assign(bits == 64 ? 2 * n : 0, 0);
+    narrow.assign(bits == 32 ? 2 * n : 0, 0);
+#pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < n; b += chunk) {
+      size_t m = std::min(chunk, n - b);
+      if (bits == 64) {
+        hash_many(points + 2 * b, m, wide.data() + 2 * b, seed);
+        continue;
+      }
+      uint64_t hs[2 * chunk];
+      hash_many(points + 2 * b, m, hs, seed);
+      for (size_t i = 0; i < 2 * m; i++)
+        narrow[2 * b + i] = static_cast<uint32_t>(hs[i]);
+    }
+  }
+
+  // the hash pairs of the m pixels from begin as 64 bit values, in the
+  // raster or decoded into buf (2 m values)
+  const uint64_t *pairs(size_t begin, size_t m, uint64_t *buf) const {
+    if (bits == 64)
+      return wide.data() + 2 * begin;
+    for (size_t i = 0; i < 2 * m; i++)
+      buf[i] = narrow[2 * begin + i];
+    return buf;
+  }
+
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  uint64_t seed() const { return hash_seed; }
+  uint32_t hash_bits() const { return bits; }
+  size_t byte_size() const {
+    return wide.size() * sizeof(uint64_t) + narrow.size() * sizeof(uint32_t);
+  }
+};
+
 /***
  *
  ***/
@@ -378,17 +659,37 @@ template <typename BITS1 = bool, typename BITS8 = uint8_t,
 struct CountingGloBiMap {
   typedef std::pair<uint32_t, uint32_t> coord_t;
 
-  typedef std::map<coord_t, uint32_t> coord_map_t;
+  // packed pixel -> count, see coord_map.hpp
+  typedef CoordMap coord_map_t;
 
   std::vector<Layer<BITS1, BITS8, BITS16, BITS32, BITS64>> layers;
   uint64_t hashcount;
 
   bool collect_input;
   coord_map_t errors;
+  // magnitudes of the errors, kept up to date by detect_errors
+  QuantileSketch error_sketch;
   coord_map_t counter;
+  // the collected input on disk instead of counter (collect_to_disk); a copy
+  // of the map copies the files
+  std::optional<ExternalCounter> spilled;
   double error_rate;
   FilterConfig config;
 
+  // probe kernels on n hash pairs, see FixedKernels
+  typedef void (*put_kernel_t)(CountingGloBiMap &, const uint64_t *, size_t);
+  typedef void (*get_min_kernel_t)(const CountingGloBiMap &, const uint64_t *,
+                                   size_t, uint64_t *);
+  put_kernel_t put_kernel = &put_generic;
+  get_min_kernel_t get_min_kernel = &get_min_generic;
+  bool specialized = false;
+  // maintain the layer statistics during put, summary() then does not scan
+  // the layers (see set_track_stats)
+  bool track_stats = false;
+  // set by compaction: the narrowed and dropped layers would cap further
+  // counts silently, so put and merge_from throw
+  bool read_only = false;
+
   CountingGloBiMap(const FilterConfig &conf, bool collect = false)
       : collect_input(collect) {
     hashcount = conf.hash_k;
@@ -406,49 +707,416 @@ struct CountingGloBiMap {
 
       layers.push_back(l);
     }
+    select_kernels();
   }
 
-  void put_all(const std::vector<uint64_t> &points) {
-    for (auto p = 0; p < points.size(); p += 2) {
-      putp(&points[p]);
+  // Factory for the probe kernels: dispatch config to a precompiled
+  // specialization from fixed_kernels_t when one exists, else use the
+  // runtime loops. Call again after changing hashcount or layers.
+  void select_kernels() {
+    put_kernel = &put_generic;
+    get_min_kernel = &get_min_generic;
+    specialized = select_from(fixed_kernels_t());
+    if (track_stats) // the fixed kernels do not count
+      put_kernel = &put_tracked;
+  }
+
+  // Collect the input out of core: pixels are counted by Morton code in
+  // sorted runs on disk in dir (see external_counter.hpp), buffer_records
+  // at a time in memory. detect_errors and get_sum_raster_collected merge
+  // the runs and stream against them. Counts collected so far move along.
+  void collect_to_disk(const std::string &dir,
+                       size_t buffer_records = 1 << 24) {
+    collect_input = true;
+    std::optional<ExternalCounter> old;
+    old.swap(spilled);
+    spilled.emplace(dir, buffer_records);
+    counter.for_each([&](uint64_t k, uint32_t v) {
+      spilled->add(morton2(CoordMap::key_x(k), CoordMap::key_y(k)), v);
+    });
+    counter.clear();
+    if (old)
+      old->for_each_unsorted(
+          [&](uint64_t code, uint64_t v) { spilled->add(code, v); });
+  }
+  bool has_collected() const {
+    return spilled ? !spilled->empty() : !counter.empty();
+  }
+  void add_collected(uint32_t x, uint32_t y, uint64_t count) {
+    if (spilled)
+      spilled->add(morton2(x, y), count);
+    else
+      counter.add(CoordMap::key(x, y), count);
+  }
+
+  // Switch the incremental layer statistics on or off; switching on scans
+  // the layers once.
+  void set_track_stats(bool on) {
+    track_stats = on;
+    if (on)
+      refresh_stats();
+    select_kernels();
+  }
+  void refresh_stats() {
+    for (auto &l : layers)
+      l.tracked = l.stats();
+  }
+  template <typename FK, typename... Rest>
+  bool select_from(KernelList<FK, Rest...>) {
+    if (FK::matches(config)) {
+      put_kernel = &FK::template put<CountingGloBiMap>;
+      get_min_kernel = &FK::template get_min<CountingGloBiMap>;
+      return true;
     }
+    return select_from(KernelList<Rest...>());
+  }
+  bool select_from(KernelList<>) { return false; }
+
+  void put_all(const std::vector<uint64_t> &points) {
+    put_many(points.data(), points.size() / 2);
   }
   void put(const std::vector<uint64_t> &point) { putp(&point[0]); }
   void putp(const uint64_t *point) {
+    check_writable();
     uint64_t h1 = H1, h2 = H2;
-    if (collect_input) {
-      coord_t p = {point[0], point[1]};
-      if (counter.count(p) == 0) {
-        counter[p] = 1;
-      } else {
-        counter[p] += 1;
+    collect(point);
+    hash(&point[0], 2, &h1, &h2);
+    put_hs(h1, h2);
+  }
+
+  // hash a group of points and prefetch their layer 0 counters, the group is
+  // then resolved with the memory accesses already in flight.
+  static constexpr size_t batch_size = 16;
+  void hash_batch(const uint64_t *points, size_t n, uint64_t *hs) const {
+    hash_many(points, n, hs, H1);
+    for (size_t j = 0; j < n; j++)
+      for (uint64_t i = 0; i < hashcount; i++)
+        layers[0].prefetch((hs[2 * j] + (i + 1) * hs[2 * j + 1]) &
+                           layers[0].mask);
+  }
+
+  void put_many(const uint64_t *points, size_t n) {
+    check_writable();
+    uint64_t hs[2 * batch_size];
+    for (size_t b = 0; b < n; b += batch_size) {
+      size_t m = std::min(batch_size, n - b);
+      hash_batch(points + 2 * b, m, hs);
+      for (size_t j = 0; j < m; j++)
+        collect(points + 2 * (b + j));
+      put_kernel(*this, hs, m);
+    }
+  }
+
+  // Concurrent ingestion: the points are split into batches over the OMP
+  // threads and every counter is incremented with a saturating atomic
+  // operation (put_atomic). The collected input (collect_input) is counted
+  // sequentially before.
+  void put_all_parallel(const std::vector<uint64_t> &points) {
+    put_many_parallel(points.data(), points.size() / 2);
+  }
+  void put_many_parallel(const uint64_t *points, size_t n) {
+    check_writable();
+    if (collect_input)
+      for (size_t j = 0; j < n; j++)
+        collect(points + 2 * j);
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t b = 0; b < n; b += batch_size) {
+      uint64_t hs[2 * batch_size];
+      size_t m = std::min(batch_size, n - b);
+      hash_batch(points + 2 * b, m, hs);
+      put_atomic(*this, hs, m);
+    }
+  }
+
+  // Sharded ingestion, the alternative to put_all_parallel without atomics:
+  // every OMP thread fills a private shard with its part of the input, the
+  // shards are then added up with merge_from. Costs one map per thread.
+  // Growing layer sizes cannot be merged (see mergeable), they are ingested
+  // with put_many_parallel instead.
+  void put_all_sharded(const std::vector<uint64_t> &points) {
+    check_writable();
+    size_t n = points.size() / 2;
+    if (!mergeable()) {
+      put_many_parallel(points.data(), n);
+      return;
+    }
+    std::vector<CountingGloBiMap> shards;
+#pragma omp parallel
+    {
+#pragma omp single
+      {
+        CountingGloBiMap proto(config, collect_input);
+        if (spilled) // the shards collect to disk as well
+          proto.collect_to_disk(spilled->directory(),
+                                spilled->buffer_size() / omp_threads());
+        shards.assign(omp_threads(), proto);
       }
+      CountingGloBiMap &shard = shards[omp_thread()];
+      size_t per = (n + shards.size() - 1) / shards.size();
+      size_t b = std::min(n, omp_thread() * per);
+      shard.put_many(points.data() + 2 * b, std::min(per, n - b));
     }
-    hash(&point[0], 2, &h1, &h2);
-    auto all_full = true;
-    for (uint64_t i = 0; i < static_cast<uint64_t>(hashcount); i++) {
-      for (auto &l : layers) {
-        uint64_t k = (h1 + (i + 1) * h2) & l.mask;
-        if (!l.threshold(k)) {
-          PARA_CRIT
-          l.increment(k);
-          all_full = false;
-          break;
-        }
+    for (auto &shard : shards)
+      merge_from(shard);
+  }
+
+  // Add the counters of a map with the same configuration (e.g. a shard or
+  // a map built in another process) layer by layer: a layer keeps
+  // min(threshold, sum) and the excess is carried into the counter of the
+  // next layer that the overflow of this counter goes to (index & mask).
+  // This is exactly the map that ingesting both inputs into one map gives.
+  // Collected input counts are added; the errors are left as they are (run
+  // detect_errors on the merged map). Throws unless mergeable().
+  void merge_from(const CountingGloBiMap &o) {
+    check_writable();
+    if (o.hashcount != hashcount || o.layers.size() != layers.size())
+      throw(std::runtime_error("merge_from needs the same configuration"));
+    for (size_t L = 0; L < layers.size(); L++)
+      if (o.layers[L].bits != layers[L].bits ||
+          o.layers[L].mask != layers[L].mask)
+        throw(std::runtime_error("merge_from needs the same configuration"));
+    if (!mergeable())
+      throw(std::runtime_error("merge_from needs non-increasing layer sizes"));
+    if (&o == this) { // the loops below would read what they write
+      CountingGloBiMap copy(o);
+      merge_from(copy);
+      return;
+    }
+
+    std::vector<uint64_t> carry_in, carry_out;
+    for (size_t L = 0; L < layers.size(); L++) {
+      bool last = L + 1 == layers.size();
+      carry_out.assign(last ? 0 : layers[L + 1].mask + 1, 0);
+      layers[L].visit([&](auto &a, auto threshold) {
+        o.layers[L].visit([&](const auto &b, auto) {
+          if constexpr (std::is_same<std::decay_t<decltype(a)>,
+                                     std::decay_t<decltype(b)>>::value)
+            merge_layer(a, b, threshold, carry_in, carry_out);
+        });
+      });
+      carry_in.swap(carry_out);
+    }
+
+    o.counter.for_each([&](uint64_t k, uint32_t v) {
+      add_collected(CoordMap::key_x(k), CoordMap::key_y(k), v);
+    });
+    if (o.spilled) {
+      o.spilled->for_each_unsorted([&](uint64_t code, uint64_t v) {
+        add_collected(morton2_x(code), morton2_y(code), v);
+      });
+    }
+    if (track_stats)
+      refresh_stats();
+  }
+
+  // The overflow of a counter goes to probe & mask of the next layer. Only
+  // if no layer is larger than the one below is that the same counter for
+  // all probes of the counter (index & mask), which merge_from needs: with a
+  // larger next layer the counts do not tell where the excess belongs.
+  bool mergeable() const {
+    for (size_t L = 0; L + 1 < layers.size(); L++)
+      if (layers[L + 1].mask > layers[L].mask)
+        return false;
+    return true;
+  }
+
+  // a[i] = min(threshold, a[i] + b[i] + in[i]), the excess is added to
+  // out[i & (out.size() - 1)]. out is empty for the last layer (excess is
+  // dropped as in put). Parallel over the positions of out, vectorized.
+  template <typename V, typename T>
+  static void merge_layer(V &a, const V &b, T threshold,
+                          const std::vector<uint64_t> &in,
+                          std::vector<uint64_t> &out) {
+    // a Bitset packs neighbours into shared words
+    const bool packed = std::is_same<V, Bitset>::value;
+    size_t n = a.size();
+    size_t chunk = out.empty() ? n : std::min(n, out.size());
+#pragma omp parallel if (!packed)
+    for (size_t base = 0; base < n; base += chunk) {
+#pragma omp for simd
+      for (size_t j = 0; j < chunk; j++) {
+        size_t i = base + j;
+        uint64_t t = static_cast<uint64_t>(a[i]);
+        uint64_t add = static_cast<uint64_t>(b[i]) + (in.empty() ? 0 : in[i]);
+        if (__builtin_add_overflow(t, add, &t)) // 64 bit layers only
+          t = UINT64_MAX;
+        uint64_t v = std::min(t, static_cast<uint64_t>(threshold));
+        a[i] = static_cast<T>(v);
+        if (!out.empty())
+          out[j] += t - v;
+      }
+    }
+  }
+
+  static size_t omp_threads() {
+#ifdef _OPENMP
+    return omp_get_num_threads();
+#else
+    return 1;
+#endif
+  }
+  static size_t omp_thread() {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+  }
+
+  void get_min_many(const uint64_t *points, size_t n, uint64_t *out) const {
+    uint64_t hs[2 * batch_size];
+    for (size_t b = 0; b < n; b += batch_size) {
+      size_t m = std::min(batch_size, n - b);
+      hash_batch(points + 2 * b, m, hs);
+      get_min_many_hs(hs, m, out + b);
+    }
+  }
+
+  // get_min of n precomputed hash pairs (see to_hashfn). All probes of a
+  // pixel are looked up in layer 0 at once (probe_min, SIMD gathers). A
+  // probe below the threshold ends its cascade there, so the layer 0
+  // minimum is the answer if it is 0 or no probe is saturated. A saturated
+  // probe continues in the next layers, where a zero counter makes the
+  // answer 0 even below the layer 0 minimum; those pixels take the full
+  // cascade through get_min_kernel.
+  void get_min_many_hs(const uint64_t *hs, size_t n, uint64_t *out) const {
+    if (layers.empty())
+      return get_min_kernel(*this, hs, n, out);
+    const auto &l0 = layers[0];
+    uint64_t max_buf[2 * batch_size];
+    for (size_t b = 0; b < n; b += 2 * batch_size) {
+      size_t m = std::min(2 * batch_size, n - b);
+      l0.visit([&](const auto &f, auto threshold) {
+        probe_min(f, l0.mask, hashcount, hs + 2 * b, m, out + b, max_buf);
+        for (size_t j = 0; j < m; j++)
+          if (out[b + j] != 0 &&
+              max_buf[j] == static_cast<uint64_t>(threshold))
+            get_min_kernel(*this, hs + 2 * (b + j), 1, out + b + j);
+      });
+    }
+  }
+
+  void collect(const uint64_t *point) {
+    if (collect_input)
+      add_collected(point[0], point[1], 1);
+  }
+
+  void check_writable() const {
+    if (read_only)
+      throw(std::runtime_error("the map is read-only after compaction"));
+  }
+
+  void put_hs(uint64_t h1, uint64_t h2) {
+    check_writable();
+    const uint64_t hs[2] = {h1, h2};
+    put_kernel(*this, hs, 1);
+  }
+
+  // The runtime kernels go layer by layer: all probes of a point are
+  // resolved in one layer (one typed loop, see Layer::visit) and only the
+  // probes that hit saturated counters move on to the next layer. A layer
+  // sees the same probes in the same order as when every probe walks down
+  // the layers on its own, so the counters are identical.
+  static const size_t probe_buffer = 64; ///< probes kept on the stack
+
+  static void put_generic(CountingGloBiMap &m, const uint64_t *hs, size_t n) {
+    put_cascade<false>(m, hs, n);
+  }
+  // put_generic maintaining the layer statistics (track_stats)
+  static void put_tracked(CountingGloBiMap &m, const uint64_t *hs, size_t n) {
+    put_cascade<true>(m, hs, n);
+  }
+  template <bool track>
+  static void put_cascade(CountingGloBiMap &m, const uint64_t *hs, size_t n) {
+    uint64_t buf[probe_buffer];
+    std::vector<uint64_t> heap;
+    uint64_t *probes = buf;
+    if (m.hashcount > probe_buffer) {
+      heap.resize(m.hashcount);
+      probes = heap.data();
+    }
+    for (size_t j = 0; j < n; j++) {
+      size_t open = m.hashcount;
+      for (size_t i = 0; i < open; i++)
+        probes[i] = hs[2 * j] + (i + 1) * hs[2 * j + 1];
+      for (size_t L = 0; L < m.layers.size() && open > 0; L++) {
+        uint64_t mask = m.layers[L].mask;
+        m.layers[L].visit([&](auto &f, auto threshold) {
+          size_t full = 0;
+          uint64_t filled = 0, max_v = 0;
+          for (size_t i = 0; i < open; i++) {
+            uint64_t k = probes[i] & mask;
+            if (f[k] != threshold) {
+              PARA_CRIT
+              f[k] = f[k] + 1;
+              if (track) {
+                uint64_t v = f[k];
+                filled += v == 1;
+                max_v = std::max(max_v, v);
+              }
+            } else {
+              probes[full++] = probes[i];
+            }
+          }
+          if (track)
+            m.layers[L].track(filled, open - full, max_v);
+          open = full;
+        });
+      }
+      // assert(open == 0); // insufficent size in filter configuration
+    }
+  }
+
+  // Thread-safe put_generic: a probe that finds its counter saturated moves
+  // on to the next layer, so no increment is lost. Every layer counter ends
+  // at min(threshold, hits) regardless of the thread interleaving; when the
+  // layers shrink (logsize not increasing), the overflow of a counter always
+  // lands on the same counter of the next layer and the result equals
+  // sequential ingestion.
+  static void put_atomic(CountingGloBiMap &m, const uint64_t *hs, size_t n) {
+    uint64_t buf[probe_buffer];
+    std::vector<uint64_t> heap;
+    uint64_t *probes = buf;
+    if (m.hashcount > probe_buffer) {
+      heap.resize(m.hashcount);
+      probes = heap.data();
+    }
+    for (size_t j = 0; j < n; j++) {
+      size_t open = m.hashcount;
+      for (size_t i = 0; i < open; i++)
+        probes[i] = hs[2 * j] + (i + 1) * hs[2 * j + 1];
+      for (size_t L = 0; L < m.layers.size() && open > 0; L++) {
+        uint64_t mask = m.layers[L].mask;
+        m.layers[L].visit([&](auto &f, auto threshold) {
+          size_t full = 0;
+          uint64_t filled = 0, added = 0, max_v = 0;
+          for (size_t i = 0; i < open; i++) {
+            uint64_t v = increment_saturating(f, probes[i] & mask, threshold);
+            if (v == 0) {
+              probes[full++] = probes[i];
+            } else {
+              filled += v == 1;
+              added++;
+              max_v = std::max(max_v, v);
+            }
+          }
+          if (m.track_stats)
+            m.layers[L].track_atomic(filled, added, max_v);
+          open = full;
+        });
       }
     }
-    // assert(!all_full); // insufficent size in filter configuration
   }
 
   bool get_bool(const std::vector<uint64_t> &point) {
     uint64_t h1 = H1, h2 = H2;
     hash(&point[0], 2, &h1, &h2);
     auto res = true;
-    for (uint64_t i = 0; i < static_cast<uint64_t>(hashcount); i++) {
-      uint64_t k = (h1 + (i + 1) * h2) & layers[0].mask;
-      uint64_t v = layers[0].template get<uint64_t>(k);
-      res = res && (v != 0);
-    }
+    uint64_t mask = layers[0].mask;
+    layers[0].visit([&](const auto &f, auto) {
+      for (uint64_t i = 0; i < hashcount && res; i++)
+        res = f[(h1 + (i + 1) * h2) & mask] != 0;
+    });
     return res;
   }
 
@@ -460,12 +1128,17 @@ struct CountingGloBiMap {
     for (size_t i = 0; i < static_cast<size_t>(hashcount); i++) {
       for (auto &l : layers) {
         uint64_t k = (h1 + (i + 1) * h2) & l.mask;
-        auto v = l.get(k);
+        uint64_t v = 0;
+        bool full = false;
+        l.visit([&](const auto &f, auto threshold) {
+          v = f[k];
+          full = f[k] == threshold;
+        });
         if (v == 0) {
           return 0;
         }
         sum += v;
-        if (!l.threshold()) {
+        if (!full) {
           break;
         }
       }
@@ -478,43 +1151,57 @@ struct CountingGloBiMap {
     uint64_t h1 = H1, h2 = H2;
 
     hash(&point[0], 2, &h1, &h2);
-    uint64_t min_v = UINT64_MAX;
-    for (auto i = 0; i < hashcount; i++) {
-      uint64_t sum = 0;
-      for (auto &l : layers) {
-        uint64_t k = (h1 + (i + 1) * h2) & l.mask;
-        auto v = l.template get<uint64_t>(k);
-        if (v == 0) {
-          return 0;
-        }
-        sum += v;
-        if (!l.threshold(k)) {
-          break;
-        }
-      }
-      min_v = std::min(min_v, sum);
-    }
-    return min_v;
+    return get_min_hs(h1, h2);
   }
   uint64_t get_min_hs(uint64_t h1, uint64_t h2) {
+    const uint64_t hs[2] = {h1, h2};
+    uint64_t min_v;
+    get_min_kernel(*this, hs, 1, &min_v);
+    return min_v;
+  }
 
-    uint64_t min_v = UINT64_MAX;
-    for (auto i = 0; i < hashcount; i++) {
-      uint64_t sum = 0;
-      for (auto &l : layers) {
-        uint64_t k = (h1 + (i + 1) * h2) & l.mask;
-        auto v = l.template get<uint64_t>(k);
-        if (v == 0) {
-          return 0;
-        }
-        sum += v;
-        if (!l.threshold(k)) {
-          break;
-        }
+  static void get_min_generic(const CountingGloBiMap &m, const uint64_t *hs,
+                              size_t n, uint64_t *out) {
+    // the probes still walking down the layers and their partial sums
+    uint64_t buf[2 * probe_buffer];
+    std::vector<uint64_t> heap;
+    uint64_t *probes = buf, *sums = buf + probe_buffer;
+    if (m.hashcount > probe_buffer) {
+      heap.resize(2 * m.hashcount);
+      probes = heap.data();
+      sums = probes + m.hashcount;
+    }
+    for (size_t j = 0; j < n; j++) {
+      size_t open = m.hashcount;
+      for (size_t i = 0; i < open; i++) {
+        probes[i] = hs[2 * j] + (i + 1) * hs[2 * j + 1];
+        sums[i] = 0;
       }
-      min_v = std::min(min_v, sum);
+      uint64_t min_v = UINT64_MAX;
+      for (size_t L = 0; L < m.layers.size() && open > 0 && min_v != 0; L++) {
+        uint64_t mask = m.layers[L].mask;
+        m.layers[L].visit([&](const auto &f, auto threshold) {
+          size_t full = 0;
+          for (size_t i = 0; i < open; i++) {
+            uint64_t v = f[probes[i] & mask];
+            if (v == 0) { // a zero counter makes the minimum zero
+              min_v = 0;
+              return;
+            }
+            if (v == threshold) {
+              probes[full] = probes[i];
+              sums[full++] = sums[i] + v;
+            } else {
+              min_v = std::min(min_v, sums[i] + v);
+            }
+          }
+          open = full;
+        });
+      }
+      for (size_t i = 0; i < open && min_v != 0; i++)
+        min_v = std::min(min_v, sums[i]);
+      out[j] = min_v;
     }
-    return min_v;
   }
 
   std::vector<uint64_t> to_hashfn(const std::vector<uint64_t> &point) {
@@ -530,44 +1217,104 @@ struct CountingGloBiMap {
     return res;
   }
 
-  uint64_t get_sum_hashfn(const std::vector<uint64_t> &hashfn) {
+  uint64_t get_sum_hashfn(const std::vector<uint64_t> &hashfn) const {
+    return get_sum_hs(hashfn.data(), hashfn.size() / 2);
+  }
+  // sum of get_min over the pixels of a HashedRaster
+  uint64_t get_sum(const HashedRaster &raster) const {
+    check_raster(raster);
+    const size_t chunk = 256;
+    size_t n = raster.size();
     uint64_t sum = 0;
-#pragma omp parallel for
-    for (auto i = 0; i < hashfn.size() - 1; i += 2) {
-#pragma omp atomic
-      sum += get_min_hs(hashfn[i], hashfn[i + 1]);
+#pragma omp parallel for reduction(+ : sum) schedule(static)
+    for (size_t b = 0; b < n; b += chunk) {
+      uint64_t buf[2 * chunk], out[chunk];
+      size_t m = std::min(chunk, n - b);
+      get_min_many_hs(raster.pairs(b, m, buf), m, out);
+      for (size_t j = 0; j < m; j++)
+        sum += out[j];
     }
     return sum;
   }
-  uint64_t get_sum_raster_collected(const std::vector<uint64_t> &raster) {
-    uint64_t sum = 0;
-#pragma omp parallel for
-    for (auto i = 0; i < raster.size() - 1; i += 2) {
-      coord_t p = {raster[i], raster[i + 1]};
-      uint64_t v = 0;
-      if (counter.count(p) != 0)
-        v = counter[p];
+  void get_min_many(const HashedRaster &raster, uint64_t *out) const {
+    check_raster(raster);
+    const size_t chunk = 256;
+    uint64_t buf[2 * chunk];
+    for (size_t b = 0; b < raster.size(); b += chunk) {
+      size_t m = std::min(chunk, raster.size() - b);
+      get_min_many_hs(raster.pairs(b, m, buf), m, out + b);
+    }
+  }
+  void check_raster(const HashedRaster &raster) const {
+    if (raster.seed() != H1)
+      throw(std::runtime_error("raster was hashed with another seed"));
+    if (raster.hash_bits() < 64)
+      for (const auto &l : layers)
+        if ((l.mask >> raster.hash_bits()) != 0)
+          throw(std::runtime_error("raster keeps too few hash bits for the "
+                                   "layers of this map"));
+  }
 
-#pragma omp atomic
-      sum += v;
+  uint64_t get_sum_hs(const uint64_t *hs, size_t n) const {
+    const size_t chunk = 256;
+    uint64_t sum = 0;
+#pragma omp parallel for reduction(+ : sum) schedule(static)
+    for (size_t b = 0; b < n; b += chunk) {
+      uint64_t out[chunk];
+      size_t m = std::min(chunk, n - b);
+      get_min_many_hs(hs + 2 * b, m, out);
+      for (size_t j = 0; j < m; j++)
+        sum += out[j];
     }
     return sum;
   }
+  uint64_t get_sum_raster_collected(const std::vector<uint64_t> &raster) {
+    if (spilled) {
+      std::vector<uint64_t> codes(raster.size() / 2);
+      for (size_t i = 0; i < codes.size(); i++)
+        codes[i] = morton2(raster[2 * i], raster[2 * i + 1]);
+      spilled->finish();
+      return spilled->sum_of(std::move(codes));
+    }
+    uint64_t sum = 0;
+#pragma omp parallel for reduction(+ : sum)
+    for (auto i = 0; i < raster.size() - 1; i += 2)
+      sum += counter.get(CoordMap::key(raster[i], raster[i + 1]));
+    return sum;
+  }
 
+  // Sum over the counters of layer 0 that are set in layer 0 of mask, with
+  // the overflow of saturated counters from the layers above. A chunk of
+  // counters walks down the layers together, one visit per layer.
   uint64_t get_sum_masked(const CountingGloBiMap &mask) {
+    const size_t chunk = 256;
+    const auto &m0 = mask.layers[0];
+    uint64_t n = layers[0].size;
     uint64_t sum = 0;
-#pragma omp parallel for
-    for (auto i = 0; i < layers[0].size; i++) {
-      if (mask.layers[0].template get<bool>(i & mask.layers[0].mask)) {
-        for (auto &l : layers) {
-          auto k = i & l.mask;
-          auto v = l.template get<uint64_t>(k);
-#pragma omp atomic
-          sum += v;
-          if (!l.threshold(k)) {
-            break;
+#pragma omp parallel for reduction(+ : sum) schedule(static)
+    for (uint64_t b = 0; b < n; b += chunk) {
+      // the counters of the chunk still walking down the layers
+      uint64_t open[chunk];
+      size_t o = 0;
+      uint64_t e = std::min<uint64_t>(n, b + chunk);
+      m0.visit([&](const auto &f, auto) {
+        for (uint64_t i = b; i < e; i++)
+          if (f[i & m0.mask] != 0)
+            open[o++] = i;
+      });
+      for (const auto &l : layers) {
+        if (o == 0)
+          break;
+        l.visit([&](const auto &f, auto threshold) {
+          size_t full = 0;
+          for (size_t j = 0; j < o; j++) {
+            auto v = f[open[j] & l.mask];
+            sum += v;
+            if (v == threshold)
+              open[full++] = open[j];
           }
-        }
+          o = full;
+        });
       }
     }
     return sum / mask.hashcount;
@@ -582,61 +1329,134 @@ struct CountingGloBiMap {
   }
 
   void detect_errors(uint64_t x, uint64_t y, uint64_t width, uint64_t height) {
-    if (counter.size() == 0) {
+    detect_errors(std::vector<Region>{{x, y, width, height}});
+  }
+
+  // Compare the map with the collected input on the pixels of the regions
+  // (which should not overlap): a pixel that was not put but reads as set is
+  // an error of 1, a put pixel an error of |get_min - count| if non-zero.
+  // The regions are cut along a grid of detect_tile x detect_tile pixels
+  // into tiles that run OMP parallel. A tile works column by column: the
+  // column is hashed in batches with prefetching and the layer 0 probes
+  // resolved with probe_min. Each thread buffers its errors, they are merged
+  // into errors at the end. A grid cell is one contiguous range of Morton
+  // codes, so with collect_to_disk a tile reads its collected pixels with a
+  // single range query.
+  static const uint64_t detect_tile = 256;
+  void detect_errors(const std::vector<Region> &regions) {
+    if (!has_collected()) {
       return;
     }
-    for (auto u = 0; u < width; u++) {
-      for (auto v = 0; v < height; v++) {
-        coord_t p = {x + u, y + v};
-        if (counter.count(p) == 0) {
-
-          if (get_bool({x + u, y + v})) {
-            errors[p] = 1;
-          }
-        } else {
-          auto m = (uint64_t)get_min({x + u, y + v});
-          uint64_t d = std::abs((int64_t)m - (int64_t)counter[p]);
-
-          if (d != 0) {
-            errors[p] = d;
-          }
+    if (spilled)
+      spilled->finish();
+    std::vector<Region> tiles;
+    uint64_t area = 0;
+    for (const auto &r : regions) {
+      area += r.width * r.height;
+      uint64_t x1 = r.x + r.width, y1 = r.y + r.height;
+      for (uint64_t u = r.x; u < x1; u = (u / detect_tile + 1) * detect_tile)
+        for (uint64_t v = r.y; v < y1; v = (v / detect_tile + 1) * detect_tile)
+          tiles.push_back(
+              {u, v, std::min((u / detect_tile + 1) * detect_tile, x1) - u,
+               std::min((v / detect_tile + 1) * detect_tile, y1) - v});
+    }
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> found;
+#pragma omp parallel
+    {
+#pragma omp single
+      found.resize(omp_threads());
+      std::vector<ExternalCounter::Record> collected;
+#pragma omp for schedule(dynamic)
+      for (size_t t = 0; t < tiles.size(); t++) {
+        const Region &r = tiles[t];
+        if (!spilled) {
+          detect_tile_errors(r, found[omp_thread()], [&](uint64_t p) {
+            return counter.get(p);
+          });
+          continue;
         }
+        spilled->range(morton2(r.x, r.y),
+                       morton2(r.x + r.width - 1, r.y + r.height - 1),
+                       collected);
+        detect_tile_errors(r, found[omp_thread()], [&](uint64_t p) {
+          uint64_t code = morton2(CoordMap::key_x(p), CoordMap::key_y(p));
+          auto it = std::lower_bound(collected.begin(), collected.end(),
+                                     ExternalCounter::Record{code, 0});
+          return it != collected.end() && it->code == code ? it->count : 0;
+        });
       }
     }
+    for (const auto &f : found)
+      for (const auto &e : f) {
+        uint32_t old = errors.get(e.first);
+        if (old != 0)
+          error_sketch.remove(old);
+        errors.set(e.first, e.second);
+        error_sketch.insert(errors.get(e.first)); // saturated
+      }
     counter.clear();
-    error_rate = (double)errors.size() / (double)(width * height);
+    if (spilled)
+      spilled->clear();
+    error_rate = (double)errors.size() / (double)area;
+  }
+
+  // count_of(p): the collected count of the packed pixel p
+  template <typename C>
+  void detect_tile_errors(const Region &t,
+                          std::vector<std::pair<uint64_t, uint64_t>> &found,
+                          C count_of) {
+    uint64_t points[2 * detect_tile], hs[2 * detect_tile], l0[detect_tile];
+    const auto &layer0 = layers[0];
+    for (uint64_t x = t.x; x < t.x + t.width; x++) {
+      size_t n = t.height;
+      for (size_t j = 0; j < n; j++) {
+        points[2 * j] = x;
+        points[2 * j + 1] = t.y + j;
+      }
+      for (size_t b = 0; b < n; b += batch_size)
+        hash_batch(points + 2 * b, std::min(batch_size, n - b), hs + 2 * b);
+      layer0.visit([&](const auto &f, auto) {
+        probe_min(f, layer0.mask, hashcount, hs, n, l0);
+      });
+      for (size_t j = 0; j < n; j++) {
+        uint64_t p = CoordMap::key(x, t.y + j);
+        uint64_t count = count_of(p);
+        if (count == 0) {
+          if (l0[j] != 0) // get_bool
+            found.push_back({p, 1});
+          continue;
+        }
+        uint64_t m;
+        get_min_kernel(*this, hs + 2 * j, 1, &m);
+        uint64_t d = std::abs((int64_t)m - (int64_t)count);
+        if (d != 0)
+          found.push_back({p, d});
+      }
+    }
   }
 
   std::vector<uint64_t> error_magnitudes() {
     std::vector<uint64_t> err_mag;
     err_mag.reserve(errors.size());
-    for (const auto &ep : errors) {
-      err_mag.push_back(ep.second);
-    }
+    errors.for_each([&](uint64_t, uint32_t v) { err_mag.push_back(v); });
     return err_mag;
   }
 
   std::string error_summary() {
     std::stringstream ss;
     ss << "{\n";
-    ss << "\"unique_input\": " << counter.size() << ",\n";
+    ss << "\"unique_input\": " << (spilled ? spilled->size() : counter.size())
+       << ",\n";
     ss << "\"errors\": " << errors.size() << ",\n";
     ss << "\"error_rate\": " << error_rate << ",\n";
 
-    auto emag = error_magnitudes();
-    auto hist = make_histogram(emag);
-    uint64_t mmin = UINT64_MAX;
-    uint64_t mmax = 0;
-    uint64_t sum = 0;
-    for (auto e : emag) {
-      mmin = std::min(e, mmin);
-      mmax = std::max(e, mmax);
-      sum += e;
-    }
-
-    double mmean = 0;
-    if (emag.size() > 0)
-      mmean = (double)sum / (double)emag.size();
+    // quantiles of the magnitudes instead of bucket means of the sorted
+    // magnitudes, within 1% relative error
+    auto hist = error_sketch.histogram(1024);
+    uint64_t mmin = error_sketch.min();
+    uint64_t mmax = error_sketch.max();
+    uint64_t sum = error_sketch.sum();
+    double mmean = error_sketch.mean();
 
     ss << "\"magnitude_min\": " << mmin << ",\n";
     ss << "\"magnitude_max\": " << mmax << ",\n";
@@ -648,12 +1468,6 @@ struct CountingGloBiMap {
     }
     ss << "]\n";
 
-    // ss << "\"magnitudes\": [";
-    // for (auto i = 0; i < emag.size(); ++i) {
-    //   ss << emag[i] << ((i < (emag.size() - 1)) ? ", " : "");
-    // }
-    // ss << "]\n";
-
     ss << "\n}" << std::endl;
     return ss.str();
   }
@@ -666,28 +1480,133 @@ struct CountingGloBiMap {
     ss << "\"mb_size\": " << (double)byte_size() / (double)(1024 * 1024)
        << ",\n";
     ss << "\"collect_input\": " << (collect_input ? "true" : "false") << ",\n";
+    ss << "\"specialized\": " << (specialized ? "true" : "false") << ",\n";
     if (collect_input) {
       ss << "\"error_summary\": " << error_summary() << ",\n";
     }
     ss << "\"layers\": [\n";
 
     for (auto i = 0; i < layers.size(); i++) {
-      ss << layers[i].summary() << ((i == layers.size() - 1) ? "\n" : ",\n");
+      ss << layers[i].summary(track_stats)
+         << ((i == layers.size() - 1) ? "\n" : ",\n");
     }
     ss << "]\n}" << std::endl;
 
     return ss.str();
   }
 
-  bool compaction() {
-    // TODO look at max values of higher layer and see if they can be
-    // collapsed by increasing bit depth of lower layers
-    for (auto i = layers.end(); i != layers.begin(); i--) {
-      if (i->stats().max == 0) {
-        layers.erase(i);
-        i = layers.end();
+  // Compaction after ingestion, returns the bytes saved. The map stays
+  // usable for get; it becomes read_only, put and merge_from throw, as the
+  // dropped and narrowed layers would cap later counts without a layer to
+  // carry into.
+  //  - layers above the first layer without a saturated counter are never
+  //    reached by put or get and are dropped
+  //  - the index space of the top layer (if not layer 0) is folded in half,
+  //    counter i + size/2 onto i, as long as no two non-zero counters meet;
+  //    nearly empty upper layers shrink to a fraction of their size
+  //  - the top layer gets the narrowest bit depth above its maximum
+  // Every non-zero counter read by get_min keeps its value. Only a probe
+  // that reads a zero in the top layer (possible when the counter below
+  // holds exactly its threshold, get_min then answers 0) can read the
+  // counter folded onto it instead.
+  uint64_t compaction() {
+    if (layers.empty())
+      return 0;
+    read_only = true;
+    uint64_t before = byte_size();
+
+    size_t top = 0;
+    while (top + 1 < layers.size() &&
+           layer_max(layers[top]) == layer_threshold(layers[top]))
+      top++;
+    layers.resize(top + 1);
+
+    while (top > 0 && layers[top].size > 1 && fold(layers[top]))
+      ;
+
+    uint64_t max_v = layer_max(layers[top]);
+    for (uint bits : {8u, 16u, 32u, 64u}) {
+      if (bits >= layers[top].bits)
+        break;
+      if (max_v < layer_threshold(bits)) {
+        layers[top] = with_bits(layers[top], bits);
+        break;
       }
     }
+
+    config.layers.resize(layers.size());
+    for (size_t L = 0; L < layers.size(); L++)
+      config.layers[L] = {layers[L].bits,
+                          static_cast<uint>(__builtin_popcountll(
+                              layers[L].mask))};
+    select_kernels();
+    if (track_stats)
+      refresh_stats();
+    return before - byte_size();
+  }
+
+  static uint64_t layer_threshold(uint bits) {
+    return bits == 64 ? THRESHOLD_64BIT
+                      : (static_cast<uint64_t>(1) << bits) - 1;
+  }
+  static uint64_t layer_threshold(const Layer<BITS1, BITS8, BITS16, BITS32,
+                                             BITS64> &l) {
+    return layer_threshold(l.bits);
+  }
+  static uint64_t layer_max(const Layer<BITS1, BITS8, BITS16, BITS32,
+                                       BITS64> &l) {
+    uint64_t max_v = 0;
+    l.visit([&](const auto &f, auto) {
+#pragma omp parallel for reduction(max : max_v)
+      for (size_t i = 0; i < f.size(); i++)
+        max_v = std::max(max_v, static_cast<uint64_t>(f[i]));
+    });
+    return max_v;
+  }
+
+  // fold counter i + size/2 onto i if no two non-zero counters collide
+  static bool fold(Layer<BITS1, BITS8, BITS16, BITS32, BITS64> &l) {
+    bool folded = false;
+    l.visit([&](auto &f, auto) {
+      size_t half = f.size() / 2;
+      bool collision = false;
+#pragma omp parallel for reduction(|| : collision)
+      for (size_t i = 0; i < half; i++)
+        collision = collision || (f[i] != 0 && f[i + half] != 0);
+      if (collision)
+        return;
+      for (size_t i = 0; i < half; i++)
+        if (f[i + half] != 0)
+          f[i] = f[i + half];
+      f.resize(half);
+      f.shrink_to_fit();
+      folded = true;
+    });
+    if (folded) {
+      l.size /= 2;
+      l.mask >>= 1;
+    }
+    return folded;
+  }
+
+  // a copy of l with another bit depth (values must fit)
+  static Layer<BITS1, BITS8, BITS16, BITS32, BITS64>
+  with_bits(const Layer<BITS1, BITS8, BITS16, BITS32, BITS64> &l, uint bits) {
+    Layer<BITS1, BITS8, BITS16, BITS32, BITS64> n;
+    n.bits = bits;
+    n.mask = l.mask;
+    n.resize(l.size);
+    n.visit([&](auto &to, auto) {
+      // a Bitset packs neighbours into shared words
+      const bool packed = std::is_same<std::decay_t<decltype(to)>,
+                                       Bitset>::value;
+      l.visit([&](const auto &from, auto) {
+#pragma omp parallel for if (!packed)
+        for (size_t i = 0; i < from.size(); i++)
+          to[i] = from[i];
+      });
+    });
+    return n;
   }
 };
 
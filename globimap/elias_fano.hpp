@@ -0,0 +1,172 @@
+/*
+Elias-Fano coding of a sorted sequence of distinct 64 bit integers, the
+compacted form of globimap::MortonIndex
+
+n values below a maximum u take 2 + log2(u / n) bits each: the lower
+low_bits bits of every value are stored verbatim in a packed array, the upper
+bits in unary in the bit vector high (value i sets bit (v_i >> low_bits) + i).
+Every sample-th one and zero of high is remembered, so select and therefore
+access and lower_bound cost a sample lookup plus a short scan.
+
+class EliasFano:
+    EliasFano(const uint64_t *v, size_t n)
+        encode n sorted, distinct values
+    uint64_t get(size_t i)
+        the i-th value
+    size_t lower_bound(uint64_t v)
+        index of the first value >= v, size() if there is none
+    Cursor cursor(size_t i)
+        sequential access from value i: value(), next(), done()
+*/
+#ifndef ELIAS_FANO_HPP
+#define ELIAS_FANO_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+namespace globimap {
+
+class EliasFano {
+  static const uint64_t sample = 256;
+
+  uint64_t n = 0;
+  uint64_t low_bits = 0;
+  uint64_t high_size = 0;      ///< bits in high
+  std::vector<uint64_t> low;   ///< n values of low_bits bits
+  std::vector<uint64_t> high;  ///< upper bits in unary
+  std::vector<uint64_t> ones;  ///< position of one i * sample in high
+  std::vector<uint64_t> zeros; ///< position of zero i * sample in high
+
+  // position of the r-th set bit (0-based) of w
+  static uint64_t select_in_word(uint64_t w, uint64_t r) {
+#ifdef __BMI2__
+    return __builtin_ctzll(_pdep_u64(static_cast<uint64_t>(1) << r, w));
+#else
+    for (; r > 0; r--)
+      w &= w - 1;
+    return __builtin_ctzll(w);
+#endif
+  }
+
+  // position of the r-th one (zero if want_ones is false) in high,
+  // starting from a sample
+  uint64_t select(uint64_t r, bool want_ones) const {
+    const std::vector<uint64_t> &s = want_ones ? ones : zeros;
+    uint64_t p = s[r / sample];
+    r -= r / sample * sample;
+    size_t wi = p / 64;
+    uint64_t w = want_ones ? high[wi] : ~high[wi];
+    w = w >> (p % 64) << (p % 64);
+    for (;;) {
+      uint64_t c = __builtin_popcountll(w);
+      if (r < c)
+        return wi * 64 + select_in_word(w, r);
+      r -= c;
+      wi++;
+      w = want_ones ? high[wi] : ~high[wi];
+    }
+  }
+
+  uint64_t get_low(size_t i) const {
+    if (low_bits == 0)
+      return 0;
+    uint64_t pos = i * low_bits, wi = pos / 64, sh = pos % 64;
+    uint64_t v = low[wi] >> sh;
+    if (sh + low_bits > 64)
+      v |= low[wi + 1] << (64 - sh);
+    return v & ((static_cast<uint64_t>(1) << low_bits) - 1);
+  }
+  bool high_bit(uint64_t p) const { return (high[p / 64] >> (p % 64)) & 1; }
+
+public:
+  EliasFano() = default;
+  EliasFano(const uint64_t *v, size_t count) : n(count) {
+    if (n == 0)
+      return;
+    uint64_t u = v[n - 1];
+    while (low_bits < 63 && (u >> (low_bits + 1)) >= n) // log2(u / n)
+      low_bits++;
+    high_size = n + (u >> low_bits) + 1;
+    low.assign((n * low_bits + 63) / 64 + 1, 0);
+    high.assign((high_size + 63) / 64 + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+      if (low_bits > 0) {
+        uint64_t l = v[i] & ((static_cast<uint64_t>(1) << low_bits) - 1);
+        uint64_t pos = i * low_bits, wi = pos / 64, sh = pos % 64;
+        low[wi] |= l << sh;
+        if (sh + low_bits > 64)
+          low[wi + 1] |= l >> (64 - sh);
+      }
+      uint64_t p = (v[i] >> low_bits) + i;
+      high[p / 64] |= static_cast<uint64_t>(1) << (p % 64);
+    }
+    for (uint64_t p = 0, o = 0, z = 0; p < high_size; p++) {
+      if (high_bit(p)) {
+        if (o++ % sample == 0)
+          ones.push_back(p);
+      } else if (z++ % sample == 0) {
+        zeros.push_back(p);
+      }
+    }
+  }
+
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  size_t byte_size() const {
+    return (low.size() + high.size() + ones.size() + zeros.size()) *
+           sizeof(uint64_t);
+  }
+
+  uint64_t get(size_t i) const {
+    return ((select(i, true) - i) << low_bits) | get_low(i);
+  }
+
+  size_t lower_bound(uint64_t v) const {
+    uint64_t h = v >> low_bits;
+    if (n == 0 || h > (high_size - n - 1))
+      return n;
+    // bucket h starts after zero h - 1
+    uint64_t p = h == 0 ? 0 : select(h - 1, false) + 1;
+    size_t i = p - h;
+    for (; i < n && high_bit(p); i++, p++)
+      if (((h << low_bits) | get_low(i)) >= v)
+        return i;
+    return i;
+  }
+
+  class Cursor {
+    const EliasFano *ef;
+    size_t i;
+    uint64_t p; ///< position of the one of value i in high
+
+  public:
+    Cursor(const EliasFano *ef, size_t i)
+        : ef(ef), i(i), p(i < ef->n ? ef->select(i, true) : 0) {}
+    bool done() const { return i >= ef->n; }
+    size_t index() const { return i; }
+    uint64_t value() const {
+      return ((p - i) << ef->low_bits) | ef->get_low(i);
+    }
+    void next() {
+      if (++i >= ef->n)
+        return;
+      p++;
+      uint64_t w = ef->high[p / 64] >> (p % 64);
+      while (w == 0) {
+        p = (p / 64 + 1) * 64;
+        w = ef->high[p / 64];
+      }
+      p += __builtin_ctzll(w);
+    }
+  };
+  Cursor cursor(size_t i) const { return Cursor(this, i); }
+};
+
+} // namespace globimap
+
+#endif
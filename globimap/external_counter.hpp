@@ -0,0 +1,424 @@
+/*
+Out-of-core pixel counts, the streaming ground truth of CountingGloBiMap
+(collect_to_disk)
+
+Counts are buffered in memory as (Morton code, count) records. A full buffer
+is sorted, equal codes are added up and the result is written to a run file.
+finish() merges all runs (at most merge_fan_in at once, in several passes if
+needed) into one sorted file with unique codes and keeps the first code of
+every block of block_records records as a sparse index in memory. Queries
+read the blocks they need with pread, so they may run concurrently.
+
+Run files are created with mkstemp in the given directory and removed when
+they are merged, on clear() and in the destructor. A copy gets copies of the
+files, so every counter owns its own.
+
+class ExternalCounter:
+    ExternalCounter(std::string dir, size_t buffer_records = 1 << 24)
+    void add(uint64_t code, uint64_t count = 1)
+        count a Morton code, spills a run when the buffer is full
+    void finish()
+        merge the runs, needed before the queries
+    uint64_t get(uint64_t code)
+        the count of a code, 0 if it was not added
+    void range(uint64_t lo, uint64_t hi, std::vector<Record> &out)
+        the records with lo <= code <= hi, in order
+    uint64_t sum_of(std::vector<uint64_t> codes)
+        sum of the counts of the codes, one sequential pass
+    void for_each(f)
+        stream f(code, count) over all records in order
+    void for_each_unsorted(f)
+        stream f(code, count) over everything added so far without finish();
+        codes may come more than once and in any order
+*/
+#ifndef EXTERNAL_COUNTER_HPP
+#define EXTERNAL_COUNTER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace globimap {
+
+class ExternalCounter {
+public:
+  struct Record {
+    uint64_t code;
+    uint64_t count;
+    bool operator<(const Record &o) const { return code < o.code; }
+  };
+
+  static const size_t block_records = 4096; ///< records per index entry
+  static const size_t merge_fan_in = 64;    ///< runs merged at once
+
+private:
+  struct Run {
+    std::string fn;
+    uint64_t records;
+  };
+
+  std::string dir;
+  size_t buffer_records;
+  std::vector<Record> buffer;
+  std::vector<Run> runs;
+  // the merged file, its descriptor and the first code of every block
+  Run merged = {"", 0};
+  int fd = -1;
+  std::vector<uint64_t> index;
+
+  // sort the records, add up equal codes
+  static void combine(std::vector<Record> &r) {
+    std::sort(r.begin(), r.end());
+    size_t n = 0;
+    for (size_t i = 0; i < r.size(); i++)
+      if (n > 0 && r[n - 1].code == r[i].code)
+        r[n - 1].count += r[i].count;
+      else
+        r[n++] = r[i];
+    r.resize(n);
+  }
+
+  Run create_run(FILE **f) const {
+    std::string fn = dir + "/globimap_run_XXXXXX";
+    int d = mkstemp(&fn[0]);
+    if (d >= 0 && (*f = fdopen(d, "wb")) == nullptr) {
+      close(d);
+      unlink(fn.c_str());
+      d = -1;
+    }
+    if (d < 0)
+      throw(std::runtime_error("cannot create run file in " + dir));
+    return {fn, 0};
+  }
+  // close f and remove its file, then throw
+  static void fail_run(FILE *f, const Run &r) {
+    fclose(f);
+    unlink(r.fn.c_str());
+    throw(std::runtime_error("cannot write " + r.fn));
+  }
+
+  void spill() {
+    combine(buffer);
+    if (buffer.empty())
+      return;
+    FILE *f;
+    Run r = create_run(&f);
+    r.records = buffer.size();
+    if (fwrite(buffer.data(), sizeof(Record), buffer.size(), f) !=
+        buffer.size())
+      fail_run(f, r);
+    if (fclose(f) != 0) {
+      unlink(r.fn.c_str());
+      throw(std::runtime_error("cannot write " + r.fn));
+    }
+    runs.push_back(r);
+    buffer.clear();
+  }
+
+  // sequential buffered reader of a run
+  struct RunReader {
+    FILE *f;
+    std::vector<Record> buf;
+    size_t pos = 0, n = 0;
+    uint64_t left;
+    RunReader(const Run &r, size_t size) : buf(size), left(r.records) {
+      f = fopen(r.fn.c_str(), "rb");
+      if (f == nullptr)
+        throw(std::runtime_error("cannot read " + r.fn));
+    }
+    ~RunReader() { fclose(f); }
+    // false at the end of the run
+    bool next(Record &r) {
+      if (pos == n) {
+        if (left == 0)
+          return false;
+        n = std::min(static_cast<uint64_t>(buf.size()), left);
+        if (fread(buf.data(), sizeof(Record), n, f) != n)
+          throw(std::runtime_error("short read of a run file"));
+        pos = 0;
+        left -= n;
+      }
+      r = buf[pos++];
+      return true;
+    }
+  };
+
+  // k-way merge of runs into one run, equal codes added up; the index is
+  // built when asked for (the last pass)
+  Run merge_runs(const std::vector<Run> &in, std::vector<uint64_t> *idx) {
+    std::vector<std::unique_ptr<RunReader>> readers;
+    typedef std::pair<uint64_t, size_t> head_t; // code, reader
+    std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t>> q;
+    std::vector<Record> heads(in.size());
+    for (size_t i = 0; i < in.size(); i++) {
+      readers.emplace_back(new RunReader(in[i], block_records));
+      if (readers[i]->next(heads[i]))
+        q.push({heads[i].code, i});
+    }
+    FILE *f;
+    Run out = create_run(&f);
+    std::vector<Record> block;
+    block.reserve(block_records);
+    auto write_block = [&]() {
+      if (fwrite(block.data(), sizeof(Record), block.size(), f) !=
+          block.size())
+        throw(std::runtime_error("cannot write " + out.fn));
+      out.records += block.size();
+      block.clear();
+    };
+    try {
+      while (!q.empty()) {
+        size_t i = q.top().second;
+        q.pop();
+        if (!block.empty() && block.back().code == heads[i].code) {
+          block.back().count += heads[i].count;
+        } else {
+          if (block.size() == block_records)
+            write_block();
+          if (idx && block.empty())
+            idx->push_back(heads[i].code);
+          block.push_back(heads[i]);
+        }
+        if (readers[i]->next(heads[i]))
+          q.push({heads[i].code, i});
+      }
+      write_block();
+    } catch (...) {
+      fclose(f);
+      unlink(out.fn.c_str());
+      throw;
+    }
+    if (fclose(f) != 0) {
+      unlink(out.fn.c_str());
+      throw(std::runtime_error("cannot write " + out.fn));
+    }
+    readers.clear();
+    for (const auto &r : in)
+      unlink(r.fn.c_str());
+    return out;
+  }
+
+  // a copy of the file of r in dir
+  Run copy_run(const Run &r) const {
+    RunReader in(r, block_records);
+    FILE *f;
+    Run out = create_run(&f);
+    Record rec;
+    while (in.next(rec)) {
+      if (fwrite(&rec, sizeof(Record), 1, f) != 1)
+        fail_run(f, out);
+      out.records++;
+    }
+    if (fclose(f) != 0) {
+      unlink(out.fn.c_str());
+      throw(std::runtime_error("cannot write " + out.fn));
+    }
+    return out;
+  }
+
+  void close_merged() {
+    if (fd >= 0)
+      close(fd);
+    if (!merged.fn.empty())
+      unlink(merged.fn.c_str());
+    fd = -1;
+    merged = {"", 0};
+    index.clear();
+  }
+
+  // records of block b
+  void read_block(size_t b, std::vector<Record> &r) const {
+    size_t first = b * block_records;
+    size_t n = std::min(static_cast<uint64_t>(block_records),
+                        merged.records - first);
+    r.resize(n);
+    size_t bytes = n * sizeof(Record);
+    if (pread(fd, r.data(), bytes, first * sizeof(Record)) !=
+        static_cast<ssize_t>(bytes))
+      throw(std::runtime_error("cannot read " + merged.fn));
+  }
+  // the block that holds code if it is there
+  size_t block_of(uint64_t code) const {
+    auto it = std::upper_bound(index.begin(), index.end(), code);
+    return it == index.begin() ? 0 : it - index.begin() - 1;
+  }
+
+public:
+  explicit ExternalCounter(const std::string &dir,
+                           size_t buffer_records = 1 << 24)
+      : dir(dir), buffer_records(std::max<size_t>(buffer_records, 1)) {}
+  ExternalCounter(const ExternalCounter &o)
+      : dir(o.dir), buffer_records(o.buffer_records), buffer(o.buffer) {
+    try {
+      for (const auto &r : o.runs)
+        runs.push_back(copy_run(r));
+      if (!o.merged.fn.empty()) {
+        merged = copy_run(o.merged);
+        index = o.index;
+        fd = open(merged.fn.c_str(), O_RDONLY);
+        if (fd < 0)
+          throw(std::runtime_error("cannot open " + merged.fn));
+      }
+    } catch (...) {
+      clear();
+      throw;
+    }
+  }
+  ExternalCounter(ExternalCounter &&o)
+      : dir(o.dir), buffer_records(o.buffer_records) {
+    *this = std::move(o);
+  }
+  ExternalCounter &operator=(const ExternalCounter &o) {
+    if (this != &o)
+      *this = ExternalCounter(o);
+    return *this;
+  }
+  ExternalCounter &operator=(ExternalCounter &&o) {
+    if (this == &o)
+      return *this;
+    clear();
+    dir = o.dir;
+    buffer_records = o.buffer_records;
+    buffer.swap(o.buffer);
+    runs.swap(o.runs);
+    std::swap(merged, o.merged);
+    std::swap(fd, o.fd);
+    index.swap(o.index);
+    return *this;
+  }
+  ~ExternalCounter() { clear(); }
+
+  const std::string &directory() const { return dir; }
+  size_t buffer_size() const { return buffer_records; }
+
+  void add(uint64_t code, uint64_t count = 1) {
+    if (buffer.size() == buffer_records)
+      spill();
+    buffer.push_back({code, count});
+  }
+
+  void finish() {
+    if (buffer.empty() && runs.empty())
+      return;
+    spill();
+    buffer.shrink_to_fit();
+    if (!merged.fn.empty()) { // merge into the previous result
+      runs.push_back(merged);
+      close(fd);
+      fd = -1;
+      merged = {"", 0};
+    }
+    while (runs.size() > merge_fan_in) {
+      std::vector<Run> next;
+      for (size_t i = 0; i < runs.size(); i += merge_fan_in)
+        next.push_back(merge_runs(
+            std::vector<Run>(runs.begin() + i,
+                             runs.begin() + std::min(runs.size(),
+                                                     i + merge_fan_in)),
+            nullptr));
+      runs.swap(next);
+    }
+    index.clear();
+    merged = merge_runs(runs, &index);
+    runs.clear();
+    fd = open(merged.fn.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw(std::runtime_error("cannot open " + merged.fn));
+  }
+
+  // unique codes after finish()
+  uint64_t size() const { return merged.records; }
+  bool empty() const {
+    return merged.records == 0 && runs.empty() && buffer.empty();
+  }
+  // bytes of memory in use (buffer and index)
+  size_t byte_size() const {
+    return buffer.capacity() * sizeof(Record) +
+           index.capacity() * sizeof(uint64_t);
+  }
+
+  void clear() {
+    close_merged();
+    for (const auto &r : runs)
+      unlink(r.fn.c_str());
+    runs.clear();
+    buffer.clear();
+  }
+
+  void range(uint64_t lo, uint64_t hi, std::vector<Record> &out) const {
+    out.clear();
+    if (merged.records == 0 || lo > hi)
+      return;
+    std::vector<Record> r;
+    for (size_t b = block_of(lo); b < index.size() && index[b] <= hi; b++) {
+      read_block(b, r);
+      auto it = std::lower_bound(r.begin(), r.end(), Record{lo, 0});
+      for (; it != r.end() && it->code <= hi; ++it)
+        out.push_back(*it);
+    }
+  }
+
+  uint64_t get(uint64_t code) const {
+    std::vector<Record> r;
+    range(code, code, r);
+    return r.empty() ? 0 : r[0].count;
+  }
+
+  // a code listed twice counts twice
+  uint64_t sum_of(std::vector<uint64_t> codes) const {
+    std::sort(codes.begin(), codes.end());
+    uint64_t sum = 0;
+    std::vector<Record> r;
+    size_t b = SIZE_MAX, pos = 0;
+    for (uint64_t c : codes) {
+      if (merged.records == 0)
+        break;
+      size_t cb = block_of(c);
+      if (cb != b) {
+        b = cb;
+        read_block(b, r);
+        pos = 0;
+      }
+      while (pos < r.size() && r[pos].code < c)
+        pos++;
+      if (pos < r.size() && r[pos].code == c)
+        sum += r[pos].count;
+    }
+    return sum;
+  }
+
+  template <typename F> void for_each(F f) const {
+    std::vector<Record> r;
+    for (size_t b = 0; b < index.size(); b++) {
+      read_block(b, r);
+      for (const auto &e : r)
+        f(e.code, e.count);
+    }
+  }
+
+  template <typename F> void for_each_unsorted(F f) const {
+    for_each(f);
+    Record rec;
+    for (const auto &run : runs) {
+      RunReader in(run, block_records);
+      while (in.next(rec))
+        f(rec.code, rec.count);
+    }
+    for (const auto &e : buffer)
+      f(e.code, e.count);
+  }
+};
+
+} // namespace globimap
+
+#endif
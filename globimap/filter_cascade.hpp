@@ -0,0 +1,131 @@
+/*
+A Bloom filter cascade deciding between two disjoint sets of Morton codes,
+the bounded-size alternative to the explicit error list of GloBiMap
+
+build(errors, positives) puts the errors into level 0. The positives that
+level 0 lets through (its false positives) go into level 1, the errors that
+pass level 1 into level 2, and so on until a level lets nothing of the other
+set through. A code of either set is then classified exactly: the first level
+it misses decides (a miss on an even level means not an error, on an odd
+level an error); a code passing all levels belongs to the set of the last
+level. Codes of neither set get an arbitrary answer.
+
+Each level has bits_per_key bits per code and round(bits_per_key * ln 2)
+probes (double hashing, mapped to the level size by multiply-shift), so the
+sets shrink geometrically and the whole cascade takes a little more than
+bits_per_key bits per error.
+
+class FilterCascade:
+    void build(std::vector<uint64_t> errors, std::vector<uint64_t> positives,
+               double bits_per_key = 8)
+        throws if a code is in both sets
+    bool is_error(uint64_t code)
+        true if the code was classified as an error
+    size_t levels(), byte_size()
+*/
+#ifndef FILTER_CASCADE_HPP
+#define FILTER_CASCADE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+#include "bitset.hpp"
+
+namespace globimap {
+
+class FilterCascade {
+  struct Level {
+    Bitset bits;
+    uint64_t m;
+    uint32_t k;
+  };
+  std::vector<Level> cascade;
+
+  static uint64_t mix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+  }
+
+  // call f(bit) for the probes of code in level l
+  template <typename F>
+  static void probes(const Level &l, size_t level, uint64_t code, F f) {
+    uint64_t h1 = mix(code ^ (level * 0x9e3779b97f4a7c15ULL));
+    uint64_t h2 = mix(h1) | 1;
+    for (uint32_t i = 0; i < l.k; i++, h1 += h2)
+      f(static_cast<uint64_t>(
+          (static_cast<unsigned __int128>(h1) * l.m) >> 64));
+  }
+  static bool test(const Level &l, size_t level, uint64_t code) {
+    bool in = true;
+    probes(l, level, code, [&](uint64_t b) { in = in && l.bits.test(b); });
+    return in;
+  }
+
+public:
+  static const size_t max_levels = 64;
+
+  void clear() { cascade.clear(); }
+  bool empty() const { return cascade.empty(); }
+  size_t levels() const { return cascade.size(); }
+  size_t byte_size() const {
+    size_t s = 0;
+    for (const auto &l : cascade)
+      s += l.bits.byte_size();
+    return s;
+  }
+
+  void build(std::vector<uint64_t> errors, std::vector<uint64_t> positives,
+             double bits_per_key = 8) {
+    for (auto *s : {&errors, &positives}) {
+      std::sort(s->begin(), s->end());
+      s->erase(std::unique(s->begin(), s->end()), s->end());
+    }
+    std::vector<uint64_t> both;
+    std::set_intersection(errors.begin(), errors.end(), positives.begin(),
+                          positives.end(), std::back_inserter(both));
+    if (!both.empty())
+      throw(std::runtime_error("a pixel is both an error and a positive"));
+
+    cascade.clear();
+    uint32_t k = std::max<uint32_t>(
+        1, std::min<uint32_t>(16, std::lround(bits_per_key * std::log(2.0))));
+    // in: the codes of this level, out: the other set, filtered down to
+    // the codes that pass this level
+    std::vector<uint64_t> *in = &errors, *out = &positives;
+    while (!in->empty()) {
+      if (cascade.size() == max_levels)
+        throw(std::runtime_error("filter cascade does not converge"));
+      size_t level = cascade.size();
+      cascade.push_back(Level());
+      Level &l = cascade.back();
+      l.m = std::max<uint64_t>(64, std::ceil(bits_per_key * in->size()));
+      l.k = k;
+      l.bits.resize(l.m);
+      for (uint64_t c : *in)
+        probes(l, level, c, [&](uint64_t b) { l.bits.set(b); });
+      out->erase(std::remove_if(out->begin(), out->end(),
+                                [&](uint64_t c) { return !test(l, level, c); }),
+                 out->end());
+      std::swap(in, out);
+    }
+  }
+
+  bool is_error(uint64_t code) const {
+    for (size_t i = 0; i < cascade.size(); i++)
+      if (!test(cascade[i], i, code))
+        return i % 2 == 1;
+    return cascade.size() % 2 == 1;
+  }
+};
+
+} // namespace globimap
+
+#endif
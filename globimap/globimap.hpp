@@ -27,30 +27,84 @@ Functions:
 (see paper) to work with hashing trick and it would  allow for prefixing)
 
 
-class Globimap:
+class Globimap<element_type, K>:
+    element_type selects the filter storage: std::vector<element_type> or, for
+    globimap::packed_bit, a globimap::Bitset of 64-bit words (1 bit per bit)
+    K > 0 fixes the number of hash functions at compile time (unrolled probe
+    loops), configure then only accepts _d == K. K = 0: set by configure.
+
     void clear()
         delete the image and the correction information. release memory
 
+    void merge_from(const GloBiMap &o)
+        union with a map of the same configuration (filter OR, OMP parallel
+        over words). An error of either map is kept if the other map does not
+        contain the pixel or has it as an error too; pixels that only become
+        false positives through the union are not known (enforce again).
+
     void setNamespace()
         set the namespace for the murmur hash multi-namespace support
 
     void add_error(std::vector<uint32_t> a)
         register an error at (a[0], a[1]) in the error correction engine
+    void compact_errors()
+        Elias-Fano encode the errors once they are complete (after enforce),
+        see MortonIndex::compact; apply_correction and get_corrected read
+        the compacted codes, add_error decodes them again
+    void build_cascade(const uint64_t *positives, size_t n,
+                       double bits_per_key = 8)
+        replace the error list by a Bloom filter cascade
+        (globimap::FilterCascade) of about bits_per_key bits per error that
+        separates the errors from the n true pixels (a[2i],a[2i+1]). The
+        correction stays exact for every pixel that is an error or among the
+        positives; pass all true pixels of the enforced regions. Errors added
+        later go to the list again, corrections consult both. Maps with a
+        cascade cannot be saved or merged, and a second build_cascade throws
+        (the cascade does not keep its errors to rebuild from).
     void put(std::vector<uint32_t> a)
-        set the pixel (a[0],a[1])
+        set the pixel (a[0],a[1]), safe to call from several threads
+    void put_many(const uint64_t *a, size_t n)
+        set the n pixels (a[2i],a[2i+1]), hashed and prefetched in batches
+    void put_parallel(const uint64_t *a, size_t n)
+        put_many, OMP loop parallel over batches
     bool get(std::vector<uint32_t> a)
         get the pixel (a[0],a[1])
-    void configure (size_t _d, size_t logm)
-        configure the filter with _d hash functions and 2^logm bit)
+    bool get_corrected(std::vector<uint64_t> a)
+        get, false for a registered error
+    void get_many(const uint64_t *a, size_t n, bool *out)
+        get the n pixels (a[2i],a[2i+1]) into out, batched like put_many
+    void map_matrix(x, y, s0, s1, const T *data, ptrdiff_t st0, ptrdiff_t st1)
+        put pixel (x+i, y+j) for every element (i,j) == 1 of an s0 x s1
+        matrix with byte strides st0, st1 (any element type, e.g. a numpy
+        view); throws if an element is neither 0 nor 1. OMP parallel tiles
+    void enforce_matrix(x, y, s0, s1, const T *data, ptrdiff_t st0,
+                        ptrdiff_t st1)
+        add_error for every element == 0 whose pixel is set, comparing
+        against rasterized tile rows
+    void configure (size_t _d, size_t logm, bool blocked = false)
+        configure the filter with _d hash functions and 2^logm bit). blocked
+        places all _d probes of a pixel into one 512 bit block (one cache
+        line) chosen by h1; positions inside the block come from h2.
     void summary()
-        give a summary (compute-intensive) of the data structure
+        give a summary (compute-intensive) of the data structure. Reports the
+        estimated false positive rate of the layout in use next to the one of
+        the unblocked layout and the cache lines touched per query.
     std::vector<double> &rasterize(uint32_t x, uint32_t y, uint32_t s0, uint32_t
 s1) rasterize the rectangle (x,y) -> (x+s0, y+s1) with stride of s1. OMP loop
 parallel
 
+    void rasterize_into(uint64_t x, uint64_t y, uint32_t s0, uint32_t s1,
+T *out) rasterize into a caller-provided buffer of s0*s1 values of any type T
+(uint8_t, bool, ...), in parallel tiles of tile_size x tile_size pixels
+
+    void rasterize_packed(uint64_t x, uint64_t y, uint32_t s0, uint32_t s1,
+uint64_t *out) as rasterize_into, one bit per pixel: row i takes
+packed_row_words(s1) words, pixel (i,j) is bit j % 64 of word j / 64
+
     std::vector<double> & apply_correction(uint32_t x, uint32_t y, uint32_t s0,
-uint32_t s1) apply correction information to suppress false-positives (OMP task
-parallel)
+uint32_t s1) apply correction information to suppress false-positives. The
+errors are kept in Morton order (globimap::MortonIndex), only the errors inside
+the window are visited
 
     void tobuffer(std::string &buf)
         serialize the buffer into a string for writing/storing/communicating
@@ -58,15 +112,39 @@ parallel)
     void frombuffer(std::string &buf, size_t n)
         deserialize the buffer from a string, n is filter size
 
+    void save(std::ostream &os) / save(const std::string &fn)
+        write the versioned binary format: a globimap::FileHeader (k, logm,
+        layout, hash id, filter size, error count, checksum), the filter as
+        raw 64 bit words and the errors as sorted Morton codes
+    void load(std::istream &is) / load(const std::string &fn)
+        read it back, configures the filter; throws on a wrong magic, version,
+        hash function, k (above 64 or not the compiled K), checksum or on
+        error codes that are not strictly increasing
+    void map_file(const std::string &fn, bool verify = false)
+        GloBiMap<packed_bit> only: open a file written by save via mmap
+        without copying the filter. All processes mapping the same file share
+        one page cache copy; get, rasterize etc. read the mapping directly.
+        The mapping is read-only: put, map_matrix and merge_from throw until
+        configure or load give the map its own filter again. verify
+        checks the checksum, which reads the whole file.
+
 */
 
 #ifndef GLOBIMAP_HPP_INC
 #define GLOBIMAP_HPP_INC
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <iterator>
 #include <limits>
 #include <list>
+#include <memory>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <tuple>
+#include <type_traits>
 #include <unordered_set>
 #include <vector>
 
@@ -75,48 +153,363 @@ parallel)
 //#define GLOBIMAP_USE_MURMUR_PREFIX
 //#define GLOBIMAP_USE_DJB64
 
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "bitset.hpp"
+#include "filter_cascade.hpp"
 #include "hashfn.hpp"
+#include "morton.hpp"
+
+namespace globimap {
+// Selects the filter storage of GloBiMap<element_type>: one element_type per
+// bit, or one bit per bit for the packed_bit tag (GloBiMap<packed_bit>).
+struct packed_bit {};
+template <typename element_type> struct filter_storage {
+  typedef std::vector<element_type> type;
+};
+template <> struct filter_storage<packed_bit> { typedef Bitset type; };
+
+// Header of the binary format written by GloBiMap::save, all fields little
+// endian. The header is followed by `words` filter words and `errors` Morton
+// codes of the corrections; the checksum covers both.
+struct FileHeader {
+  char magic[8];     ///< "GLOBIMAP"
+  uint32_t version;  ///< file_version
+  uint32_t hash_id;  ///< GLOBIMAP_HASH_ID of the writer
+  uint32_t k;        ///< number of hash functions
+  uint32_t logm;     ///< log2 of the filter size in bits
+  uint32_t flags;    ///< bit 0: blocked layout
+  uint32_t reserved; ///< 0
+  uint64_t bits;     ///< filter size in bits
+  uint64_t words;    ///< filter words following the header
+  uint64_t errors;   ///< error codes following the filter words
+  uint64_t checksum; ///< checksum64 over words, then errors
+};
+static const char file_magic[8] = {'G', 'L', 'O', 'B', 'I', 'M', 'A', 'P'};
+static const uint32_t file_version = 1;
+static const uint32_t file_flag_blocked = 1;
+} // namespace globimap
 
-template <typename element_type = bool> class GloBiMap {
+template <typename element_type = bool, size_t K = 0> class GloBiMap {
 public:
   uint64_t maxhash = 0; ///< was used for debugging that the hash numbers
                         ///< actually are large enough
-  typedef std::set<std::pair<uint32_t, uint32_t>>
-      error_container_t; // could be unordered_set dep. on your situation.
-  std::vector<element_type> filter;
+  typedef globimap::MortonIndex error_container_t;
+  typedef typename globimap::filter_storage<element_type>::type filter_t;
+  filter_t filter;
+  static const uint64_t block_bits = 512; ///< one 64 byte cache line
 
 private:
   int d;
   uint64_t mask;
+  // number of probes, a compile time constant for K > 0 so that the probe
+  // loops can be unrolled
+  inline size_t hashes() const {
+    return K > 0 ? K : static_cast<size_t>(d);
+  }
+  bool blocked = false;
+  uint64_t block_mask;   ///< selects the block (blocked layout)
+  uint64_t inblock_mask; ///< selects the bit inside the block
+
+  // the probe parameters of configure, the filter is left as it is
+  void set_layout(size_t _d, size_t logm, bool _blocked) {
+    if (K > 0 && _d != K)
+      throw(std::runtime_error("hash count differs from the compiled K"));
+    d = _d;
+    mask = (static_cast<uint64_t>(1) << logm) - 1;
+    blocked = _blocked;
+    inblock_mask = std::min(mask, block_bits - 1);
+    block_mask = mask & ~inblock_mask;
+  }
+
+  // a filter attached to a read-only file mapping (map_file)
+  template <typename T> static bool mapped(const std::vector<T> &) {
+    return false;
+  }
+  static bool mapped(const globimap::Bitset &f) { return f.attached(); }
+  void check_writable() const {
+    if (mapped(filter))
+      throw(std::runtime_error("the filter is a read-only file mapping"));
+  }
+
+  // position of the i-th probe for the hash pair h1, h2
+  inline uint64_t probe(uint64_t h1, uint64_t h2, size_t i) const {
+    if (blocked) { // multiplicative hashing of h2 rotated by 9 bits per probe
+      uint64_t r = (9 * i) & 63;
+      uint64_t x = (h2 << r) | (h2 >> ((64 - r) & 63));
+      return (h1 & block_mask) |
+             (((x * 0x9e3779b97f4a7c15ULL) >> 55) & inblock_mask);
+    }
+    return (h1 + (i + 1) * h2) & mask;
+  }
 
 protected:
   std::vector<double> storage;
   error_container_t errors;
+  globimap::FilterCascade cascade;
+
+  // storage access, overloaded on the filter type
+  template <typename T> static void set_bit(std::vector<T> &f, uint64_t k) {
+    if constexpr (std::is_same<T, bool>::value) {
+      // std::vector<bool> shares words between elements
+#pragma omp critical
+      f[k] = 1;
+    } else {
+      __atomic_store_n(&f[k], static_cast<T>(1), __ATOMIC_RELAXED);
+    }
+  }
+  static void set_bit(globimap::Bitset &f, uint64_t k) { f.set_atomic(k); }
+  template <typename T>
+  static bool test_bit(const std::vector<T> &f, uint64_t k) {
+    return f[k] != 0;
+  }
+  static bool test_bit(const globimap::Bitset &f, uint64_t k) {
+    return f.test(k);
+  }
+  template <typename T>
+  static void prefetch_bit(const std::vector<T> &f, uint64_t k) {
+    if constexpr (!std::is_same<T, bool>::value)
+      __builtin_prefetch(&f[k]);
+  }
+  static void prefetch_bit(const globimap::Bitset &f, uint64_t k) {
+    f.prefetch(k);
+  }
+  template <typename T> static size_t count_ones(const std::vector<T> &f) {
+    size_t ones = 0;
+#pragma omp parallel for reduction(+ : ones)
+    for (size_t i = 0; i < f.size(); i++) {
+      if (f[i] != 0)
+        ones++;
+    }
+    return ones;
+  }
+  static size_t count_ones(const globimap::Bitset &f) { return f.count(); }
+  template <typename T>
+  static size_t count_ones(const std::vector<T> &f, size_t begin, size_t end) {
+    size_t ones = 0;
+    for (size_t i = begin; i < end; i++)
+      ones += (f[i] != 0);
+    return ones;
+  }
+  static size_t count_ones(const globimap::Bitset &f, size_t begin,
+                           size_t end) {
+    // blocks smaller than a word (logm < 6) share it, mask the partial first
+    // and last word
+    if (begin >= end)
+      return 0;
+    size_t first = begin / 64, last = (end - 1) / 64;
+    size_t ones = 0;
+    for (size_t w = first; w <= last; w++) {
+      uint64_t word = f.data()[w];
+      if (w == first)
+        word &= ~static_cast<uint64_t>(0) << (begin % 64);
+      if (w == last && end % 64 != 0)
+        word &= (static_cast<uint64_t>(1) << (end % 64)) - 1;
+      ones += __builtin_popcountll(word);
+    }
+    return ones;
+  }
+
+  template <typename T>
+  static void to_bytes(const std::vector<T> &f, std::string &buf) {
+    buf.clear();
+    buf.reserve((f.size() + 7) / 8);
+    char ch = 0;
+    for (size_t i = 0; i < f.size(); i++) {
+      auto bit = i % 8;
+      ch |= (f[i] << bit);
+      if (bit == 7) {
+        // full byte has been built.
+        buf += ch;
+        ch = 0;
+      }
+    }
+    if (f.size() % 8 != 0) // we have collected beyond the end.
+      buf += ch;
+  }
+  static void to_bytes(const globimap::Bitset &f, std::string &buf) {
+    f.to_bytes(buf);
+  }
+  template <typename T>
+  static void from_bytes(std::vector<T> &f, const unsigned char *buf,
+                         size_t buf_size, size_t n) {
+    f.resize(n);
+    size_t k = 0;
+    for (size_t i = 0; i < buf_size; i++) {
+      char ch = *(buf + i);
+      for (size_t j = 0; j < 8; j++)
+        if (k < n)
+          f[k++] = (ch >> j) & 1;
+    }
+  }
+  static void from_bytes(globimap::Bitset &f, const unsigned char *buf,
+                         size_t buf_size, size_t n) {
+    f.from_bytes(buf, buf_size, n);
+  }
+
+  // the filter as 64 bit words, tmp holds them for unpacked storage
+  template <typename T>
+  static const uint64_t *to_words(const std::vector<T> &f,
+                                  std::vector<uint64_t> &tmp) {
+    tmp.assign((f.size() + 63) / 64, 0);
+    for (size_t i = 0; i < f.size(); i++)
+      if (f[i] != 0)
+        tmp[i / 64] |= static_cast<uint64_t>(1) << (i % 64);
+    return tmp.data();
+  }
+  static const uint64_t *to_words(const globimap::Bitset &f,
+                                  std::vector<uint64_t> &) {
+    return f.data();
+  }
+  // where to read n words to, then from_words moves them into the filter
+  template <typename T>
+  static uint64_t *word_target(std::vector<T> &, std::vector<uint64_t> &tmp,
+                               size_t n) {
+    tmp.resize(n);
+    return tmp.data();
+  }
+  static uint64_t *word_target(globimap::Bitset &f, std::vector<uint64_t> &,
+                               size_t) {
+    return f.data();
+  }
+  template <typename T>
+  static void from_words(std::vector<T> &f, const std::vector<uint64_t> &tmp) {
+    for (size_t i = 0; i < f.size(); i++)
+      f[i] = (tmp[i / 64] >> (i % 64)) & 1;
+  }
+  static void from_words(globimap::Bitset &f, const std::vector<uint64_t> &) {
+    f.resize(f.size()); // clear the bits beyond the end
+  }
+
+  // f |= o, same size
+  template <typename T>
+  static void or_into(std::vector<T> &f, const std::vector<T> &o) {
+    if constexpr (std::is_same<T, bool>::value) {
+      for (size_t i = 0; i < f.size(); i++) // shared words, sequential
+        if (o[i])
+          f[i] = true;
+    } else {
+#pragma omp parallel for simd
+      for (size_t i = 0; i < f.size(); i++)
+        f[i] = f[i] | o[i];
+    }
+  }
+  static void or_into(globimap::Bitset &f, const globimap::Bitset &o) {
+    uint64_t *w = f.data();
+    const uint64_t *v = o.data();
+#pragma omp parallel for simd
+    for (size_t i = 0; i < f.word_count(); i++)
+      w[i] |= v[i];
+  }
+
+  // the error codes of a map that are still errors after a union with o:
+  // pixels o does not have or has as an error as well
+  static std::vector<uint64_t> valid_errors(const globimap::MortonIndex &e,
+                                            const GloBiMap &o) {
+    std::vector<uint64_t> tmp;
+    const uint64_t *codes = e.sorted(tmp);
+    size_t n = e.size();
+    std::vector<uint64_t> pts(2 * n);
+    for (size_t i = 0; i < n; i++) {
+      pts[2 * i] = globimap::morton2_x(codes[i]);
+      pts[2 * i + 1] = globimap::morton2_y(codes[i]);
+    }
+    std::unique_ptr<bool[]> in_o(new bool[n]);
+    o.get_many(pts.data(), n, in_o.get());
+    std::vector<uint64_t> valid;
+    for (size_t i = 0; i < n; i++)
+      if (!in_o[i] || o.errors.contains(pts[2 * i], pts[2 * i + 1]))
+        valid.push_back(codes[i]);
+    return valid;
+  }
 
 public:
   void clear() {
     filter.clear();
     errors.clear();
+    cascade.clear();
+  }
+
+  void merge_from(const GloBiMap &o) {
+    check_writable();
+    if (o.d != d || o.mask != mask || o.blocked != blocked)
+      throw(std::runtime_error("merge_from needs the same configuration"));
+    if (!cascade.empty() || !o.cascade.empty())
+      throw(std::runtime_error("merge_from does not support filter cascades"));
+    // re-validate the errors against the other filter before the union
+    std::vector<uint64_t> mine = valid_errors(errors, o);
+    std::vector<uint64_t> theirs = valid_errors(o.errors, *this);
+    std::vector<uint64_t> merged;
+    merged.reserve(mine.size() + theirs.size());
+    std::set_union(mine.begin(), mine.end(), theirs.begin(), theirs.end(),
+                   std::back_inserter(merged));
+
+    or_into(filter, o.filter);
+    errors.assign(std::move(merged));
   }
 
   void add_error(std::vector<uint32_t> a) {
     //    std::cout <<"Adding error information for " << a[0]<< "/" << a[1] <<
     //    std::endl;
-    errors.emplace(std::make_pair(a[0], a[1]));
+    errors.insert(a[0], a[1]);
+  }
+  void compact_errors() { errors.compact(); }
+
+  void build_cascade(const uint64_t *positives, size_t n,
+                     double bits_per_key = 8) {
+    if (!cascade.empty())
+      throw(std::runtime_error("the map already has a filter cascade"));
+    // only positives that pass the filter can be confused with errors
+    std::unique_ptr<bool[]> in(new bool[n]);
+    get_many(positives, n, in.get());
+    std::vector<uint64_t> pos, tmp;
+    for (size_t i = 0; i < n; i++)
+      if (in[i])
+        pos.push_back(
+            globimap::morton2(positives[2 * i], positives[2 * i + 1]));
+    const uint64_t *codes = errors.sorted(tmp);
+    cascade.build(std::vector<uint64_t>(codes, codes + errors.size()),
+                  std::move(pos), bits_per_key);
+    errors.clear();
+  }
+  bool is_error(uint64_t x, uint64_t y) const {
+    return errors.contains(x, y) ||
+           (!cascade.empty() && cascade.is_error(globimap::morton2(x, y)));
+  }
+
+  // hash a group of points and prefetch the first probes of each, the group
+  // is then resolved with the memory accesses already in flight. Queries
+  // usually stop at the first zero bit, so get_many only prefetches
+  // get_prefetch probes while put_many prefetches all of them.
+  static constexpr size_t batch_size = 16;
+  static constexpr size_t get_prefetch = 2;
+  void hash_batch(const uint64_t *a, size_t n, uint64_t *hs,
+                  size_t probes) const {
+    probes = blocked ? 1 : std::min(probes, hashes());
+    hash_many(a, n, hs, 8589845122);
+    for (size_t j = 0; j < n; j++)
+      for (size_t i = 0; i < probes; i++)
+        prefetch_bit(filter, probe(hs[2 * j], hs[2 * j + 1], i));
   }
 
   void put(std::vector<uint64_t> a) { return putp(&a[0]); }
-  void putp(uint64_t *a) {
+  void putp(const uint64_t *a) {
+    check_writable();
     //    std::cout << "put" << a[0] << ";" << a[1] <<";";
 
     // get the two hashs:
     uint64_t h1 = 8589845122, h2 = 8465418721;
-    double maxp = 0;
     hash(a, 2, &h1, &h2);
-    for (size_t i = 0; i < static_cast<size_t>(d); i++) {
-      uint64_t k = (h1 + (i + 1) * h2) & mask;
+    put_hs(h1, h2);
+  }
+  void put_hs(uint64_t h1, uint64_t h2) {
+    double maxp = 0;
+    for (size_t i = 0; i < hashes(); i++) {
+      uint64_t k = probe(h1, h2, i);
 
 #ifdef GLOBIMAP_COMPUTE_MAXHASH
       if (k > maxhash)
@@ -130,30 +523,65 @@ public:
       std::cout << k << "(;" << static_cast<long double>(k) / mask << ") => "
                 << maxp << std::endl;
 #endif
-#pragma omp critical
-      filter[k] = 1;
+      set_bit(filter, k); // thread-safe, no lock for packed_bit
     }
 #ifdef DEBUG_HASH_PUT
     std::cout << std::endl;
 #endif
   }
 
+  void put_many(const uint64_t *a, size_t n) {
+    check_writable();
+    uint64_t hs[2 * batch_size];
+    for (size_t b = 0; b < n; b += batch_size) {
+      size_t m = std::min(batch_size, n - b);
+      hash_batch(a + 2 * b, m, hs, d);
+      for (size_t j = 0; j < m; j++)
+        put_hs(hs[2 * j], hs[2 * j + 1]);
+    }
+  }
+
+  void put_parallel(const uint64_t *a, size_t n) {
+    check_writable(); // before the parallel region, see put_many
+#pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < n; b += batch_size)
+      put_many(a + 2 * b, std::min(batch_size, n - b));
+  }
+  void put_parallel(const std::vector<uint64_t> &a) {
+    put_parallel(a.data(), a.size() / 2);
+  }
+
   bool get(std::vector<uint64_t> a) { return getp(&a[0]); }
-  bool getp(uint64_t *a) {
+  bool get_corrected(std::vector<uint64_t> a) const {
+    return getp(&a[0]) && !is_error(a[0], a[1]);
+  }
+  bool getp(const uint64_t *a) const {
     //    std::cout << "GET for " << a[0] << "/" << a[1] << std::endl;
     uint64_t h1 = 8589845122, h2 = 8465418721;
     hash(a, 2, &h1, &h2);
-    for (size_t i = 0; i < static_cast<size_t>(d); i++) {
-      uint64_t k = (h1 + (i + 1) * h2) & mask;
-      if (filter[k] == 0)
+    return get_hs(h1, h2);
+  }
+  bool get_hs(uint64_t h1, uint64_t h2) const {
+    for (size_t i = 0; i < hashes(); i++) {
+      uint64_t k = probe(h1, h2, i);
+      if (!test_bit(filter, k))
         return false;
     }
     return true;
   }
 
-  void configure(size_t _d, size_t logm) {
-    d = _d;
-    mask = (static_cast<uint64_t>(1) << logm) - 1;
+  void get_many(const uint64_t *a, size_t n, bool *out) const {
+    uint64_t hs[2 * batch_size];
+    for (size_t b = 0; b < n; b += batch_size) {
+      size_t m = std::min(batch_size, n - b);
+      hash_batch(a + 2 * b, m, hs, get_prefetch);
+      for (size_t j = 0; j < m; j++)
+        out[b + j] = get_hs(hs[2 * j], hs[2 * j + 1]);
+    }
+  }
+
+  void configure(size_t _d, size_t logm, bool _blocked = false) {
+    set_layout(_d, logm, _blocked);
     // std::cout << "logm:" << logm << "mask=" << std::hex << "0x" <<
     // mask << std::dec << std::endl;
     filter.resize(mask + 1);
@@ -161,20 +589,37 @@ public:
   }
 
   std::tuple<double, double> stats() {
-    size_t ones = 0;
-#pragma omp parallel for
-    for (size_t i = 0; i < filter.size(); i++) {
-      if (filter[i] == 1)
-#pragma omp atomic
-        ones++;
-    }
+    size_t ones = count_ones(filter);
     return std::make_tuple(static_cast<double>(ones),
                            static_cast<double>((filter.size() - ones)) /
                                (double)filter.size());
   }
 
+  // expected false positive rate of the current fill: (ones/m)^d for the
+  // unblocked layout, the mean over blocks of drawing d distinct set bits
+  // for the blocked one.
+  std::tuple<double, double> fpr_estimate() {
+    double m = static_cast<double>(filter.size());
+    double unblocked = std::pow(std::get<0>(stats()) / m, d);
+    if (!blocked)
+      return std::make_tuple(unblocked, unblocked);
+    size_t bs = inblock_mask + 1;
+    size_t nblocks = filter.size() / bs;
+    double sum = 0;
+#pragma omp parallel for reduction(+ : sum)
+    for (size_t b = 0; b < nblocks; b++) {
+      double ones = count_ones(filter, b * bs, (b + 1) * bs);
+      double p = 1;
+      for (int j = 0; j < d; j++)
+        p *= std::max(0.0, ones - j) / (bs - j);
+      sum += p;
+    }
+    return std::make_tuple(sum / nblocks, unblocked);
+  }
+
   std::string summary() {
     auto st = stats();
+    auto fpr = fpr_estimate();
     std::stringstream ss;
     //       ss << std::hex << t1 << std::endl << t2 << std::endl << t3 <<
     //       std::endl << std::dec;
@@ -191,94 +636,315 @@ public:
        << std::endl;
     ss << "\"ones:\": " << std::get<0>(st) << "," << std::endl;
     ss << "\"foz:\": " << std::get<1>(st) << "," << std::endl;
-    ss << "\"eci\": " << errors.size() << std::endl;
+    ss << "\"blocked\": " << (blocked ? "true" : "false") << "," << std::endl;
+    ss << "\"fpr_est\": " << std::get<0>(fpr) << "," << std::endl;
+    ss << "\"fpr_est_unblocked\": " << std::get<1>(fpr) << "," << std::endl;
+    ss << "\"cachelines_per_query\": " << (blocked ? 1 : d) << ","
+       << std::endl;
+    ss << "\"eci\": " << errors.size() << "," << std::endl;
+    ss << "\"eci_bytes\": " << errors.byte_size() << "," << std::endl;
+    ss << "\"cascade_levels\": " << cascade.levels() << "," << std::endl;
+    ss << "\"cascade_bytes\": " << cascade.byte_size() << std::endl;
     ss << "}" << std::endl;
     return ss.str();
   }
 
   std::vector<double> &rasterize(uint64_t x, uint64_t y, uint32_t s0,
                                  uint32_t s1) {
-    storage.resize(s0 * s1);
-#pragma omp parallel for
-    for (uint32_t i = 0; i < s0; i++)
-      for (uint32_t j = 0; j < s1; j++) {
-        storage[i * s1 + j] = get({x + i, y + j});
-      }
+    storage.resize(static_cast<size_t>(s0) * s1);
+    rasterize_into(x, y, s0, s1, storage.data());
     return storage;
   }
 
+  // tiles are processed row by row through get_many, a tile row is one word
+  // of packed output
+  static constexpr uint32_t tile_size = 64;
+  void get_row(uint64_t x, uint64_t y, uint32_t n, bool *row) const {
+    uint64_t coords[2 * tile_size];
+    for (uint32_t j = 0; j < n; j++) {
+      coords[2 * j] = x;
+      coords[2 * j + 1] = y + j;
+    }
+    get_many(coords, n, row);
+  }
+
+  template <typename T>
+  void rasterize_into(uint64_t x, uint64_t y, uint32_t s0, uint32_t s1,
+                      T *out) const {
+    uint32_t t0 = (s0 + tile_size - 1) / tile_size;
+    uint32_t t1 = (s1 + tile_size - 1) / tile_size;
+#pragma omp parallel for collapse(2) schedule(dynamic)
+    for (uint32_t ti = 0; ti < t0; ti++)
+      for (uint32_t tj = 0; tj < t1; tj++) {
+        bool row[tile_size];
+        uint32_t j0 = tj * tile_size;
+        uint32_t n = std::min(s1 - j0, tile_size);
+        uint32_t i1 = std::min(s0, (ti + 1) * tile_size);
+        for (uint32_t i = ti * tile_size; i < i1; i++) {
+          get_row(x + i, y + j0, n, row);
+          T *o = out + static_cast<size_t>(i) * s1 + j0;
+          for (uint32_t j = 0; j < n; j++)
+            o[j] = row[j];
+        }
+      }
+  }
+
+  // element (i, j) of a matrix with byte strides st0, st1
+  template <typename T>
+  static T matrix_at(const T *data, ptrdiff_t st0, ptrdiff_t st1, uint32_t i,
+                     uint32_t j) {
+    return *reinterpret_cast<const T *>(reinterpret_cast<const char *>(data) +
+                                        i * st0 + j * st1);
+  }
+
+  // put the pixels that are 1 in the matrix, in parallel tiles; every tile
+  // row is hashed as one batch
+  template <typename T>
+  void map_matrix(uint64_t x, uint64_t y, uint32_t s0, uint32_t s1,
+                  const T *data, ptrdiff_t st0, ptrdiff_t st1) {
+    check_writable();
+    uint32_t t0 = (s0 + tile_size - 1) / tile_size;
+    uint32_t t1 = (s1 + tile_size - 1) / tile_size;
+    bool binary = true;
+#pragma omp parallel for collapse(2) schedule(dynamic) reduction(&& : binary)
+    for (uint32_t ti = 0; ti < t0; ti++)
+      for (uint32_t tj = 0; tj < t1; tj++) {
+        uint64_t coords[2 * tile_size];
+        uint32_t j0 = tj * tile_size;
+        uint32_t j1 = std::min(s1, j0 + tile_size);
+        uint32_t i1 = std::min(s0, (ti + 1) * tile_size);
+        for (uint32_t i = ti * tile_size; i < i1; i++) {
+          size_t n = 0;
+          for (uint32_t j = j0; j < j1; j++) {
+            T v = matrix_at(data, st0, st1, i, j);
+            binary = binary && (v == T(0) || v == T(1));
+            if (v == T(1)) {
+              coords[2 * n] = x + i;
+              coords[2 * n++ + 1] = y + j;
+            }
+          }
+          put_many(coords, n);
+        }
+      }
+    if (!binary)
+      throw(std::runtime_error("data is not binary."));
+  }
+
+  // register the pixels that are 0 in the matrix but set in the filter as
+  // errors: every tile row is rasterized with get_row and compared in one
+  // pass, the errors of a tile are inserted at its end
+  template <typename T>
+  void enforce_matrix(uint64_t x, uint64_t y, uint32_t s0, uint32_t s1,
+                      const T *data, ptrdiff_t st0, ptrdiff_t st1) {
+    uint32_t t0 = (s0 + tile_size - 1) / tile_size;
+    uint32_t t1 = (s1 + tile_size - 1) / tile_size;
+#pragma omp parallel for collapse(2) schedule(dynamic)
+    for (uint32_t ti = 0; ti < t0; ti++)
+      for (uint32_t tj = 0; tj < t1; tj++) {
+        bool row[tile_size];
+        std::vector<std::pair<uint32_t, uint32_t>> found;
+        uint32_t j0 = tj * tile_size;
+        uint32_t n = std::min(s1 - j0, tile_size);
+        uint32_t i1 = std::min(s0, (ti + 1) * tile_size);
+        for (uint32_t i = ti * tile_size; i < i1; i++) {
+          get_row(x + i, y + j0, n, row);
+          for (uint32_t j = 0; j < n; j++)
+            if (row[j] && matrix_at(data, st0, st1, i, j0 + j) == T(0))
+              found.push_back({static_cast<uint32_t>(x + i),
+                               static_cast<uint32_t>(y + j0 + j)});
+        }
+        if (!found.empty()) {
+#pragma omp critical(globimap_errors)
+          for (const auto &e : found)
+            errors.insert(e.first, e.second);
+        }
+      }
+    errors.flush(); // merge now, not in the first (maybe parallel) query
+  }
+
+  static size_t packed_row_words(uint32_t s1) { return (s1 + 63) / 64; }
+  void rasterize_packed(uint64_t x, uint64_t y, uint32_t s0, uint32_t s1,
+                        uint64_t *out) const {
+    size_t words = packed_row_words(s1);
+#pragma omp parallel for collapse(2) schedule(dynamic)
+    for (uint32_t ti = 0; ti < (s0 + tile_size - 1) / tile_size; ti++)
+      for (uint32_t tj = 0; tj < words; tj++) {
+        bool row[tile_size];
+        uint32_t j0 = tj * tile_size;
+        uint32_t n = std::min(s1 - j0, tile_size);
+        uint32_t i1 = std::min(s0, (ti + 1) * tile_size);
+        for (uint32_t i = ti * tile_size; i < i1; i++) {
+          get_row(x + i, y + j0, n, row);
+          uint64_t w = 0;
+          for (uint32_t j = 0; j < n; j++)
+            w |= static_cast<uint64_t>(row[j]) << j;
+          out[i * words + tj] = w;
+        }
+      }
+  }
+
   std::vector<double> &apply_correction(uint32_t x, uint32_t y, uint32_t s0,
                                         uint32_t s1) {
     // apply corrections over storage
-    if (storage.size() != s0 * s1)
+    if (storage.size() != static_cast<size_t>(s0) * s1)
       throw(std::runtime_error("corrections can only be applied after "
                                "rasterize with same extends (parameters!)"));
-/*
-task-based parallelism: the loop through the list is on a single scope, yet the
-processing is parallel
-*/
-#pragma omp parallel
-#pragma omp single
-    {
-      for (auto it = errors.begin(); it != errors.end(); ++it)
-#pragma omp task firstprivate(it)
-      {
-        auto first = (it->first - x);
-        auto second = (it->second - y);
-        if (first >= 0 && second >= 0 && first < s0 && second < s1)
-          storage[first * s1 + second] = 0;
-      }
-#pragma omp taskwait
+    if (s0 == 0 || s1 == 0)
+      return storage;
+    uint32_t x1 = static_cast<uint32_t>(
+        std::min<uint64_t>(static_cast<uint64_t>(x) + s0 - 1, UINT32_MAX));
+    uint32_t y1 = static_cast<uint32_t>(
+        std::min<uint64_t>(static_cast<uint64_t>(y) + s1 - 1, UINT32_MAX));
+    errors.for_each_in(x, y, x1, y1, [&](uint32_t ex, uint32_t ey) {
+      storage[static_cast<size_t>(ex - x) * s1 + (ey - y)] = 0;
+    });
+    if (!cascade.empty()) {
+#pragma omp parallel for schedule(static)
+      for (uint32_t i = 0; i < s0; i++)
+        for (uint32_t j = 0; j < s1; j++) {
+          double &v = storage[static_cast<size_t>(i) * s1 + j];
+          if (v != 0 && cascade.is_error(globimap::morton2(x + i, y + j)))
+            v = 0;
+        }
     }
     return storage;
   }
 
-  void tobuffer(std::string &buf) {
-    buf.clear();
-    char ch = 0;
-    for (size_t i = 0; i < filter.size(); i++) {
-      auto bit = i % 8;
-      ch |= (filter[i] << bit);
-      if (bit == 7) {
-        // full byte has been built.
-        buf += ch;
-        ch = 0;
-      }
-    }
-    if (filter.size() % 8 != 0) // we have collected beyond the end.
-      buf += ch;
-  }
+  void tobuffer(std::string &buf) { to_bytes(filter, buf); }
 
   void from_buffer(const unsigned char *buf, size_t buf_size, size_t n) {
-    filter.resize(n);
-    size_t k = 0;
-    for (size_t i = 0; i < buf_size; i++) {
-      char ch = *(buf + i);
-      for (size_t j = 0; j < 8; j++)
-        if (k < n)
-          filter[k++] = ch & (1 << j);
-    }
+    from_bytes(filter, buf, buf_size, n);
   }
   void _frombuffer(std::string &buf, size_t n) {
-    filter.resize(n);
-    size_t k = 0;
-    for (size_t i = 0; i < buf.size(); i++) {
-      char ch = buf[i];
-      for (size_t j = 0; j < 8; j++)
-        if (k < n)
-          filter[k++] = ch & (1 << j);
-    }
+    from_bytes(filter, reinterpret_cast<const unsigned char *>(buf.data()),
+               buf.size(), n);
   }
 
-  void _frombuffer(std::string &buf) {
-    size_t k = 0;
-    auto n = filter.size();
-    for (size_t i = 0; i < buf.size(); i++) {
-      char ch = buf[i];
-      for (size_t j = 0; j < 8; j++)
-        if (k < n)
-          filter[k++] = ch & (1 << j);
+  void _frombuffer(std::string &buf) { _frombuffer(buf, filter.size()); }
+
+  void save(std::ostream &os) {
+    if (!cascade.empty())
+      throw(std::runtime_error("a filter cascade cannot be saved"));
+    std::vector<uint64_t> tmp, codes_tmp;
+    const uint64_t *words = to_words(filter, tmp);
+    const uint64_t *codes = errors.sorted(codes_tmp);
+
+    globimap::FileHeader h = {};
+    memcpy(h.magic, globimap::file_magic, sizeof(h.magic));
+    h.version = globimap::file_version;
+    h.hash_id = GLOBIMAP_HASH_ID;
+    h.k = d;
+    h.logm = __builtin_popcountll(mask);
+    h.flags = blocked ? globimap::file_flag_blocked : 0;
+    h.bits = filter.size();
+    h.words = (filter.size() + 63) / 64;
+    h.errors = errors.size();
+    h.checksum = checksum64(codes, h.errors, checksum64(words, h.words));
+
+    os.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    os.write(reinterpret_cast<const char *>(words), h.words * 8);
+    os.write(reinterpret_cast<const char *>(codes), h.errors * 8);
+    if (!os)
+      throw(std::runtime_error("writing the filter failed"));
+  }
+  void save(const std::string &fn) {
+    std::ofstream os(fn, std::ios::binary);
+    save(os);
+  }
+
+  // the header comes from the file and is not trusted: len is the file size
+  // (header included), the words and errors must fit into it before anything
+  // is allocated
+  static void check_header(const globimap::FileHeader &h, uint64_t len) {
+    if (memcmp(h.magic, globimap::file_magic, sizeof(h.magic)) != 0)
+      throw(std::runtime_error("not a globimap file"));
+    if (h.version != globimap::file_version)
+      throw(std::runtime_error("unsupported globimap file version"));
+    if (h.hash_id != GLOBIMAP_HASH_ID)
+      throw(std::runtime_error("filter was written with another hash"));
+    if (h.k == 0 || h.k > 64 || h.logm >= 64 ||
+        h.bits != (uint64_t{1} << h.logm) || h.words != (h.bits + 63) / 64)
+      throw(std::runtime_error("inconsistent globimap file header"));
+    if (K > 0 && h.k != K)
+      throw(std::runtime_error("hash count differs from the compiled K"));
+    uint64_t body = len > sizeof(h) ? (len - sizeof(h)) / 8 : 0;
+    if (h.words > body || h.errors > body - h.words)
+      throw(std::runtime_error("globimap file is truncated"));
+  }
+
+  // compact_errors builds Elias-Fano from the codes, which needs them sorted
+  static void check_codes(const uint64_t *codes, uint64_t n) {
+    for (uint64_t i = 1; i < n; i++)
+      if (codes[i] <= codes[i - 1])
+        throw(std::runtime_error("globimap file errors are not sorted"));
+  }
+
+  // streams that cannot seek are not bounded before the reads
+  void load(std::istream &is) {
+    uint64_t len = UINT64_MAX;
+    std::streampos start = is.tellg();
+    if (start != std::streampos(-1)) {
+      if (is.seekg(0, std::ios::end))
+        len = static_cast<uint64_t>(is.tellg() - start);
+      is.clear();
+      is.seekg(start);
     }
+    globimap::FileHeader h;
+    is.read(reinterpret_cast<char *>(&h), sizeof(h));
+    if (!is)
+      throw(std::runtime_error("not a globimap file"));
+    check_header(h, len);
+
+    configure(h.k, h.logm, h.flags & globimap::file_flag_blocked);
+    std::vector<uint64_t> tmp, codes(h.errors);
+    uint64_t *words = word_target(filter, tmp, h.words);
+    is.read(reinterpret_cast<char *>(words), h.words * 8);
+    is.read(reinterpret_cast<char *>(codes.data()), h.errors * 8);
+    if (!is)
+      throw(std::runtime_error("globimap file is truncated"));
+    if (checksum64(codes.data(), codes.size(), checksum64(words, h.words)) !=
+        h.checksum)
+      throw(std::runtime_error("globimap file checksum mismatch"));
+    check_codes(codes.data(), codes.size());
+    from_words(filter, tmp);
+    errors.assign(std::move(codes));
+  }
+  void load(const std::string &fn) {
+    std::ifstream is(fn, std::ios::binary);
+    load(is);
+  }
+
+  void map_file(const std::string &fn, bool verify = false) {
+    static_assert(std::is_same<filter_t, globimap::Bitset>::value,
+                  "map_file needs the packed filter, GloBiMap<packed_bit>");
+    int fd = open(fn.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw(std::runtime_error("cannot open " + fn));
+    struct stat st;
+    size_t len = fstat(fd, &st) == 0 ? st.st_size : 0;
+    void *base = len >= sizeof(globimap::FileHeader)
+                     ? mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0)
+                     : MAP_FAILED;
+    close(fd); // the mapping stays valid
+    if (base == MAP_FAILED)
+      throw(std::runtime_error("cannot map " + fn));
+    std::shared_ptr<void> owner(base, [len](void *p) { munmap(p, len); });
+
+    const globimap::FileHeader &h =
+        *reinterpret_cast<const globimap::FileHeader *>(base);
+    check_header(h, len);
+    uint64_t *words = reinterpret_cast<uint64_t *>(
+        static_cast<char *>(base) + sizeof(h));
+    const uint64_t *codes = words + h.words;
+    if (verify && checksum64(codes, h.errors, checksum64(words, h.words)) !=
+                      h.checksum)
+      throw(std::runtime_error("globimap file checksum mismatch"));
+    check_codes(codes, h.errors);
+
+    // everything is checked, the map changes only now
+    errors.assign(std::vector<uint64_t>(codes, codes + h.errors));
+    set_layout(h.k, h.logm, h.flags & globimap::file_flag_blocked);
+    filter.attach(owner, words, h.bits);
   }
 };
 
@@ -10,10 +10,15 @@
 
 #include <string.h>
 
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
 #ifdef GLOBIMAP_USE_MURMUR
 #include "murmur.hpp"
 
 #ifdef GLOBIMAP_USE_MURMUR_PREFIX
+#define GLOBIMAP_HASH_ID 2
 inline void hash(const uint64_t *data, size_t len, uint64_t *v1, uint64_t *v2,
                  const char *prefix = "") {
   uint64_t hash[2];
@@ -24,21 +29,192 @@ inline void hash(const uint64_t *data, size_t len, uint64_t *v1, uint64_t *v2,
   *v1 = hash[0];
   *v2 = hash[1];
 }
+// the batched interface of the plain variant, without SIMD
+inline void hash16(const uint64_t *data, uint64_t *v1, uint64_t *v2) {
+  hash(data, 2, v1, v2);
+}
+inline void hash_many(const uint64_t *data, size_t n, uint64_t *hs,
+                      uint64_t seed) {
+  for (size_t i = 0; i < n; i++) {
+    hs[2 * i] = seed;
+    hash16(data + 2 * i, &hs[2 * i], &hs[2 * i + 1]);
+  }
+}
 #else
+#define GLOBIMAP_HASH_ID 1
+/*
+MurmurHash3_x64_128 specialized to one 16 byte block (a 2D coordinate): no
+loop and no tail. hash16 is bit-identical to MurmurHash3_x64_128(data, 16,
+*v1), so existing filters stay valid. hash_many hashes n coordinates into the
+interleaved pairs hs[2i], hs[2i+1], 8 at a time with AVX-512 or 4 at a time
+with AVX2.
+*/
+inline void hash16(const uint64_t *data, uint64_t *v1, uint64_t *v2) {
+  const uint64_t c1 = BIG_CONSTANT(0x87c37b91114253d5);
+  const uint64_t c2 = BIG_CONSTANT(0x4cf5ad432745937f);
+  uint64_t h1 = static_cast<uint32_t>(*v1);
+  uint64_t h2 = h1;
+
+  uint64_t k1 = data[0] * c1;
+  k1 = murmur::rotl64(k1, 31) * c2;
+  h1 ^= k1;
+  h1 = murmur::rotl64(h1, 27) + h2;
+  h1 = h1 * 5 + 0x52dce729;
+
+  uint64_t k2 = data[1] * c2;
+  k2 = murmur::rotl64(k2, 33) * c1;
+  h2 ^= k2;
+  h2 = murmur::rotl64(h2, 31) + h1;
+  h2 = h2 * 5 + 0x38495ab5;
+
+  h1 ^= 16;
+  h2 ^= 16;
+  h1 += h2;
+  h2 += h1;
+  h1 = murmur::fmix64(h1);
+  h2 = murmur::fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  *v1 = h1;
+  *v2 = h2;
+}
+
 inline void hash(const uint64_t *data, const size_t len, uint64_t *v1,
                  uint64_t *v2) {
-  uint64_t hash[2];
-  /*    char buffer[1024];
-      snprintf(buffer, 1024,"%s-%lu-%lu", prefix,data[0],data[1]);*/
-  murmur::MurmurHash3_x64_128(data, 16, *v1,
-                              (void *)hash); // len*sizeof(uint64_t)
-  *v1 = hash[0];
-  *v2 = hash[1];
+  // same as murmur::MurmurHash3_x64_128(data, 16, *v1, ...)
+  hash16(data, v1, v2);
+}
+
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+namespace murmur_simd {
+inline __m512i rotl(__m512i x, int r) {
+  return _mm512_rolv_epi64(x, _mm512_set1_epi64(r));
+}
+inline __m512i mul(__m512i a, uint64_t b) {
+  return _mm512_mullo_epi64(a, _mm512_set1_epi64(b));
+}
+inline __m512i fmix(__m512i k) {
+  k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+  k = mul(k, BIG_CONSTANT(0xff51afd7ed558ccd));
+  k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+  k = mul(k, BIG_CONSTANT(0xc4ceb9fe1a85ec53));
+  return _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+}
+// 8 coordinates, see hash16
+inline void hash16_x8(const uint64_t *data, uint64_t seed, uint64_t *hs) {
+  const uint64_t c1 = BIG_CONSTANT(0x87c37b91114253d5);
+  const uint64_t c2 = BIG_CONSTANT(0x4cf5ad432745937f);
+  __m512i a = _mm512_loadu_si512(data);
+  __m512i b = _mm512_loadu_si512(data + 8);
+  // lanes hold the points in the order 0,4,1,5,2,6,3,7
+  __m512i k1 = _mm512_unpacklo_epi64(a, b);
+  __m512i k2 = _mm512_unpackhi_epi64(a, b);
+  __m512i h1 = _mm512_set1_epi64(static_cast<uint32_t>(seed));
+  __m512i h2 = h1;
+
+  k1 = mul(rotl(mul(k1, c1), 31), c2);
+  h1 = _mm512_add_epi64(rotl(_mm512_xor_si512(h1, k1), 27), h2);
+  h1 = _mm512_add_epi64(_mm512_add_epi64(_mm512_slli_epi64(h1, 2), h1),
+                        _mm512_set1_epi64(0x52dce729));
+
+  k2 = mul(rotl(mul(k2, c2), 33), c1);
+  h2 = _mm512_add_epi64(rotl(_mm512_xor_si512(h2, k2), 31), h1);
+  h2 = _mm512_add_epi64(_mm512_add_epi64(_mm512_slli_epi64(h2, 2), h2),
+                        _mm512_set1_epi64(0x38495ab5));
+
+  h1 = _mm512_xor_si512(h1, _mm512_set1_epi64(16));
+  h2 = _mm512_xor_si512(h2, _mm512_set1_epi64(16));
+  h1 = _mm512_add_epi64(h1, h2);
+  h2 = _mm512_add_epi64(h2, h1);
+  h1 = fmix(h1);
+  h2 = fmix(h2);
+  h1 = _mm512_add_epi64(h1, h2);
+  h2 = _mm512_add_epi64(h2, h1);
+  // undo the lane order while interleaving h1, h2
+  _mm512_storeu_si512(hs, _mm512_unpacklo_epi64(h1, h2));
+  _mm512_storeu_si512(hs + 8, _mm512_unpackhi_epi64(h1, h2));
+}
+} // namespace murmur_simd
+#elif defined(__AVX2__)
+namespace murmur_simd {
+inline __m256i rotl(__m256i x, int r) {
+  return _mm256_or_si256(_mm256_slli_epi64(x, r), _mm256_srli_epi64(x, 64 - r));
+}
+// 64 bit multiplication from three 32x32 bit products
+inline __m256i mul(__m256i a, uint64_t b) {
+  __m256i bl = _mm256_set1_epi64x(b);
+  __m256i bh = _mm256_set1_epi64x(b >> 32);
+  __m256i lo = _mm256_mul_epu32(a, bl);
+  __m256i cross = _mm256_add_epi64(
+      _mm256_mul_epu32(_mm256_srli_epi64(a, 32), bl), _mm256_mul_epu32(a, bh));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+inline __m256i fmix(__m256i k) {
+  k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+  k = mul(k, BIG_CONSTANT(0xff51afd7ed558ccd));
+  k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+  k = mul(k, BIG_CONSTANT(0xc4ceb9fe1a85ec53));
+  return _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+}
+// 4 coordinates, see hash16
+inline void hash16_x4(const uint64_t *data, uint64_t seed, uint64_t *hs) {
+  const uint64_t c1 = BIG_CONSTANT(0x87c37b91114253d5);
+  const uint64_t c2 = BIG_CONSTANT(0x4cf5ad432745937f);
+  __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+  __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 4));
+  // lanes hold the points in the order 0,2,1,3
+  __m256i k1 = _mm256_unpacklo_epi64(a, b);
+  __m256i k2 = _mm256_unpackhi_epi64(a, b);
+  __m256i h1 = _mm256_set1_epi64x(static_cast<uint32_t>(seed));
+  __m256i h2 = h1;
+
+  k1 = mul(rotl(mul(k1, c1), 31), c2);
+  h1 = _mm256_add_epi64(rotl(_mm256_xor_si256(h1, k1), 27), h2);
+  h1 = _mm256_add_epi64(_mm256_add_epi64(_mm256_slli_epi64(h1, 2), h1),
+                        _mm256_set1_epi64x(0x52dce729));
+
+  k2 = mul(rotl(mul(k2, c2), 33), c1);
+  h2 = _mm256_add_epi64(rotl(_mm256_xor_si256(h2, k2), 31), h1);
+  h2 = _mm256_add_epi64(_mm256_add_epi64(_mm256_slli_epi64(h2, 2), h2),
+                        _mm256_set1_epi64x(0x38495ab5));
+
+  h1 = _mm256_xor_si256(h1, _mm256_set1_epi64x(16));
+  h2 = _mm256_xor_si256(h2, _mm256_set1_epi64x(16));
+  h1 = _mm256_add_epi64(h1, h2);
+  h2 = _mm256_add_epi64(h2, h1);
+  h1 = fmix(h1);
+  h2 = fmix(h2);
+  h1 = _mm256_add_epi64(h1, h2);
+  h2 = _mm256_add_epi64(h2, h1);
+  // undo the lane order while interleaving h1, h2
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(hs),
+                      _mm256_unpacklo_epi64(h1, h2));
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(hs + 4),
+                      _mm256_unpackhi_epi64(h1, h2));
+}
+} // namespace murmur_simd
+#endif
+
+inline void hash_many(const uint64_t *data, size_t n, uint64_t *hs,
+                      uint64_t seed) {
+  size_t i = 0;
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+  for (; i + 8 <= n; i += 8)
+    murmur_simd::hash16_x8(data + 2 * i, seed, hs + 2 * i);
+#elif defined(__AVX2__)
+  for (; i + 4 <= n; i += 4)
+    murmur_simd::hash16_x4(data + 2 * i, seed, hs + 2 * i);
+#endif
+  for (; i < n; i++) {
+    hs[2 * i] = seed;
+    hash16(data + 2 * i, &hs[2 * i], &hs[2 * i + 1]);
+  }
 }
 #endif
 #endif
 
 #ifdef GLOBIMAP_USE_DJB64
+#define GLOBIMAP_HASH_ID 3
 
 // This should not be used, it would need careful evaluation on many layers.
 // Stays here for completeness!!!
@@ -67,6 +243,7 @@ inline void hash(uint32_t *data, size_t len, uint32_t *v1, uint32_t *v2) {
 #endif
 
 #ifdef GLOBIMAP_USE_LOOKUP3
+#define GLOBIMAP_HASH_ID 4
 // This should not be used, it would need careful evaluation on many layers. Not
 // published, google for lookup3.h ;-)
 #include "lookup3.hpp"
@@ -76,4 +253,22 @@ inline void hash(uint32_t *data, size_t len, uint32_t *v1, uint32_t *v2) {
 }
 #endif
 
+// Order-sensitive checksum of n 64 bit words (OMP parallel): the sum of the
+// murmur3 finalizer over the words salted with their index (independent of
+// the hash function selected above).
+inline uint64_t checksum64(const uint64_t *w, size_t n, uint64_t seed = 0) {
+  uint64_t sum = seed;
+#pragma omp parallel for reduction(+ : sum)
+  for (size_t i = 0; i < n; i++) {
+    uint64_t k = w[i] ^ (i * 0x9e3779b97f4a7c15ULL);
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    sum += k;
+  }
+  return sum;
+}
+
 #endif
\ No newline at end of file
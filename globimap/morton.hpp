@@ -0,0 +1,264 @@
+/*
+Morton order (Z-order) for 2D pixel coordinates and a Morton-ordered point
+set used as the error correction store of GloBiMap
+
+morton2(x, y) interleaves x into the even and y into the odd bits, so pixels
+that are close in space are mostly close in the code. A rectangular window
+covers the code range [morton2(x0, y0), morton2(x1, y1)]; codes in that range
+but outside the window are skipped with bigmin (Tropf and Herzog, 1981), which
+gives the next code inside the window.
+
+class MortonIndex:
+    void insert(uint32_t x, uint32_t y)
+        add a pixel, O(1): inserts are buffered and merged by flush() or the
+        next query. The merge runs under a lock, so the const queries may run
+        concurrently (but not concurrently with insert)
+    bool contains(uint32_t x, uint32_t y)
+        binary search
+    void for_each_in(x0, y0, x1, y1, f)
+        call f(x, y) for every pixel in the window [x0,x1] x [y0,y1] (inclusive)
+        in Morton order. Costs one binary search to the window, one step per
+        pixel in the window and a bigmin plus a binary search, O(log n), per
+        run of codes in [morton2(x0,y0), morton2(x1,y1)] outside the window
+    void compact()
+        re-encode the codes with Elias-Fano (elias_fano.hpp), about
+        2 + log2(max code / n) bits per pixel instead of 64; the queries work
+        on the compacted codes, an insert decodes them again
+*/
+#ifndef MORTON_HPP
+#define MORTON_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "elias_fano.hpp"
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+namespace globimap {
+
+static const uint64_t MORTON_X = 0x5555555555555555ULL; ///< bits of x
+static const uint64_t MORTON_Y = 0xaaaaaaaaaaaaaaaaULL; ///< bits of y
+
+inline uint64_t morton_spread(uint32_t v) {
+#ifdef __BMI2__
+  return _pdep_u64(v, MORTON_X);
+#else
+  uint64_t x = v;
+  x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+  x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+  x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  x = (x | (x << 2)) & 0x3333333333333333ULL;
+  x = (x | (x << 1)) & 0x5555555555555555ULL;
+  return x;
+#endif
+}
+
+inline uint32_t morton_compact(uint64_t x) {
+#ifdef __BMI2__
+  return static_cast<uint32_t>(_pext_u64(x, MORTON_X));
+#else
+  x &= 0x5555555555555555ULL;
+  x = (x | (x >> 1)) & 0x3333333333333333ULL;
+  x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+  x = (x | (x >> 4)) & 0x00ff00ff00ff00ffULL;
+  x = (x | (x >> 8)) & 0x0000ffff0000ffffULL;
+  x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+  return static_cast<uint32_t>(x);
+#endif
+}
+
+inline uint64_t morton2(uint32_t x, uint32_t y) {
+  return morton_spread(x) | (morton_spread(y) << 1);
+}
+inline uint32_t morton2_x(uint64_t z) { return morton_compact(z); }
+inline uint32_t morton2_y(uint64_t z) { return morton_compact(z >> 1); }
+
+inline bool morton2_inside(uint64_t z, uint64_t zmin, uint64_t zmax) {
+  uint64_t x = z & MORTON_X, y = z & MORTON_Y;
+  return x >= (zmin & MORTON_X) && x <= (zmax & MORTON_X) &&
+         y >= (zmin & MORTON_Y) && y <= (zmax & MORTON_Y);
+}
+
+// smallest code > z inside the window with corners zmin, zmax (z must lie
+// in [zmin, zmax] but outside the window)
+inline uint64_t bigmin(uint64_t z, uint64_t zmin, uint64_t zmax) {
+  uint64_t result = 0;
+  for (int b = 63; b >= 0; b--) {
+    uint64_t bit = static_cast<uint64_t>(1) << b;
+    // lower bits of the same dimension as bit b
+    uint64_t lower = (b % 2 == 0 ? MORTON_X : MORTON_Y) & (bit - 1);
+    int v = (z & bit) != 0, lo = (zmin & bit) != 0, hi = (zmax & bit) != 0;
+    if (v == 0 && lo == 0 && hi == 1) {
+      result = (zmin & ~lower) | bit;
+      zmax = (zmax & ~bit) | lower;
+    } else if (v == 0 && lo == 1 && hi == 1) {
+      return zmin;
+    } else if (v == 1 && lo == 0 && hi == 0) {
+      return result;
+    } else if (v == 1 && lo == 0 && hi == 1) {
+      zmin = (zmin & ~lower) | bit;
+    }
+    // (0,0,0) and (1,1,1) continue, (x,1,0) cannot happen for zmin <= zmax
+  }
+  return result;
+}
+
+class MortonIndex {
+  // inserts are merged lazily, also by the const queries: flush merges under
+  // merge_lock, a query that finds dirty unset (acquire) sees the merged state
+  mutable std::vector<uint64_t> codes;   ///< sorted and unique
+  mutable std::vector<uint64_t> pending; ///< inserted since the last merge
+  mutable EliasFano packed;              ///< the codes after compact()
+  mutable bool is_compact = false;
+  mutable std::atomic<bool> dirty{false}; ///< pending is not empty
+  mutable std::mutex merge_lock;
+
+  void merge() const {
+    if (is_compact) {
+      codes.clear();
+      for (auto c = packed.cursor(0); !c.done(); c.next())
+        codes.push_back(c.value());
+      packed = EliasFano();
+      is_compact = false;
+    }
+    std::sort(pending.begin(), pending.end());
+    size_t n = codes.size();
+    codes.insert(codes.end(), pending.begin(), pending.end());
+    std::inplace_merge(codes.begin(), codes.begin() + n, codes.end());
+    codes.erase(std::unique(codes.begin(), codes.end()), codes.end());
+    pending.clear();
+  }
+
+public:
+  MortonIndex() = default;
+  MortonIndex(const MortonIndex &o) { *this = o; }
+  MortonIndex &operator=(const MortonIndex &o) {
+    if (this == &o)
+      return *this;
+    o.flush();
+    codes = o.codes;
+    pending.clear();
+    packed = o.packed;
+    is_compact = o.is_compact;
+    dirty = false;
+    return *this;
+  }
+
+  void insert(uint32_t x, uint32_t y) {
+    pending.push_back(morton2(x, y));
+    dirty.store(true, std::memory_order_relaxed);
+  }
+
+  void clear() {
+    codes.clear();
+    codes.shrink_to_fit();
+    pending.clear();
+    pending.shrink_to_fit();
+    packed = EliasFano();
+    is_compact = false;
+    dirty = false;
+  }
+
+  void flush() const {
+    if (!dirty.load(std::memory_order_acquire))
+      return;
+    std::lock_guard<std::mutex> lock(merge_lock);
+    if (!dirty.load(std::memory_order_relaxed))
+      return;
+    merge();
+    dirty.store(false, std::memory_order_release);
+  }
+
+  size_t size() const {
+    flush();
+    return is_compact ? packed.size() : codes.size();
+  }
+  size_t byte_size() const {
+    flush();
+    return is_compact ? packed.byte_size() : codes.size() * sizeof(uint64_t);
+  }
+
+  void compact() {
+    flush();
+    if (is_compact)
+      return;
+    packed = EliasFano(codes.data(), codes.size());
+    codes.clear();
+    codes.shrink_to_fit();
+    is_compact = true;
+  }
+  bool compacted() const {
+    flush();
+    return is_compact;
+  }
+
+  // the size() sorted Morton codes of all pixels, decoded into tmp if the
+  // index is compacted
+  const uint64_t *sorted(std::vector<uint64_t> &tmp) const {
+    flush();
+    if (!is_compact)
+      return codes.data();
+    tmp.clear();
+    tmp.reserve(packed.size());
+    for (auto c = packed.cursor(0); !c.done(); c.next())
+      tmp.push_back(c.value());
+    return tmp.data();
+  }
+  // replace the content by sorted, unique Morton codes
+  void assign(std::vector<uint64_t> sorted_codes) {
+    codes = std::move(sorted_codes);
+    pending.clear();
+    packed = EliasFano();
+    is_compact = false;
+    dirty = false;
+  }
+
+  bool contains(uint32_t x, uint32_t y) const {
+    flush();
+    uint64_t z = morton2(x, y);
+    if (is_compact) {
+      auto c = packed.cursor(packed.lower_bound(z));
+      return !c.done() && c.value() == z;
+    }
+    return std::binary_search(codes.begin(), codes.end(), z);
+  }
+
+  template <typename F>
+  void for_each_in(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1,
+                   F f) const {
+    flush();
+    uint64_t zmin = morton2(x0, y0), zmax = morton2(x1, y1);
+    if (is_compact) {
+      auto c = packed.cursor(packed.lower_bound(zmin));
+      while (!c.done() && c.value() <= zmax) {
+        if (morton2_inside(c.value(), zmin, zmax)) {
+          f(morton2_x(c.value()), morton2_y(c.value()));
+          c.next();
+        } else {
+          c = packed.cursor(packed.lower_bound(bigmin(c.value(), zmin, zmax)));
+        }
+      }
+      return;
+    }
+    auto it = std::lower_bound(codes.begin(), codes.end(), zmin);
+    while (it != codes.end() && *it <= zmax) {
+      if (morton2_inside(*it, zmin, zmax)) {
+        f(morton2_x(*it), morton2_y(*it));
+        ++it;
+      } else {
+        it = std::lower_bound(it, codes.end(), bigmin(*it, zmin, zmax));
+      }
+    }
+  }
+};
+
+} // namespace globimap
+
+#endif
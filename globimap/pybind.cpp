@@ -11,6 +11,7 @@ namespace py = pybind11;
 // This holds the actual implementation. Copy this header to your projects (and
 // a hasher, for example murmur.hpp)
 
+#include "counting_globimap.hpp"
 #include "globimap.hpp"
 
 // Wrap 2D C++ array (given as pointer) to a numpy object.
@@ -34,26 +35,25 @@ template <typename T> static py::array_t<T> wrap1D(T *data, size_t s) {
       shape, strides, data);
 }
 
-// This template is a handy tool to call a function f(i,j,value) for each entry
-// of a 2D matrix self. template<typename func> static void
-void map_matrix(const py::array_t<double> &self,
-                std::function<void(int, int, double)> f) {
-  if (self.ndim() != 2)
+// Call f(data, s0, s1, st0, st1) with the typed data and byte strides of a 2D
+// array: bool and uint8 arrays are used as they are, anything else is
+// converted to double.
+template <typename F> static void with_matrix(const py::array &mat, F f) {
+  if (mat.ndim() != 2)
     throw(std::runtime_error("2D array expected"));
-  auto s1 = self.strides(0);
-  auto s2 = self.strides(1);
-  const char *data = reinterpret_cast<const char *>(self.data());
-
-  for (int i1 = 0; i1 < self.shape(0); i1++) {
-    for (int i2 = 0; i2 < self.shape(1); i2++) {
-      size_t offset = i1 * s1 + i2 * s2;
-      // std::cout <<"("<< offset<<", "<<i1 <<", "<<i2 <<"), ";
-      const double *d = reinterpret_cast<const double *>(data + offset);
-      f(i1, i2, *d);
-    }
-  }
-  std::cout << std::endl;
+  uint32_t s0 = mat.shape(0), s1 = mat.shape(1);
+  if (mat.dtype().is(py::dtype::of<bool>()))
+    return f(static_cast<const bool *>(mat.data()), s0, s1, mat.strides(0),
+             mat.strides(1));
+  if (mat.dtype().is(py::dtype::of<uint8_t>()))
+    return f(static_cast<const uint8_t *>(mat.data()), s0, s1,
+             mat.strides(0), mat.strides(1));
+  auto d = py::array_t<double, py::array::forcecast>::ensure(mat);
+  if (!d)
+    throw(std::runtime_error("numeric 2D array expected"));
+  f(d.data(), s0, s1, d.strides(0), d.strides(1));
 }
+
 template <typename T>
 void map_pointcloud(const py::array_t<T> &self,
                     std::function<void(int, int)> f) {
@@ -75,8 +75,19 @@ void map_pointcloud(const py::array_t<T> &self,
 }
 
 // This wil be our implementation in C++ of a Python class globimap.
-typedef GloBiMap<uint8_t> globimap_t;
-typedef GloBiMap<uint8_t> globimap_t;
+// The filter is bit-packed (64-bit words), see bitset.hpp.
+typedef GloBiMap<globimap::packed_bit> globimap_t;
+// The multi-layer counting variant, see counting_globimap.hpp.
+typedef globimap::CountingGloBiMap<> counting_globimap_t;
+
+// (n,2) uint64 coordinate array
+typedef py::array_t<uint64_t, py::array::c_style | py::array::forcecast>
+    coords_t;
+static size_t coord_count(const coords_t &coords) {
+  if (coords.ndim() != 2 || coords.shape(1) != 2)
+    throw(std::runtime_error("(n,2) array of coordinates expected"));
+  return coords.shape(0);
+}
 
 // The module begins
 PYBIND11_MODULE(globimap, m) {
@@ -88,6 +99,29 @@ PYBIND11_MODULE(globimap, m) {
              auto &data = self.rasterize(x, y, s0, s1);
              return wrap2D<double>((double *)&data[0], s0, s1);
            })
+      .def("rasterize_bool",
+           +[](globimap_t &self, size_t x, size_t y, size_t s0,
+               size_t s1) -> py::array_t<bool> {
+             py::array_t<bool> res({s0, s1});
+             bool *out = res.mutable_data();
+             {
+               py::gil_scoped_release release;
+               self.rasterize_into(x, y, s0, s1, out);
+             }
+             return res;
+           })
+      .def("rasterize_packed",
+           +[](globimap_t &self, size_t x, size_t y, size_t s0,
+               size_t s1) -> py::array_t<uint64_t> {
+             py::array_t<uint64_t> res(
+                 {s0, globimap_t::packed_row_words(s1)});
+             uint64_t *out = res.mutable_data();
+             {
+               py::gil_scoped_release release;
+               self.rasterize_packed(x, y, s0, s1, out);
+             }
+             return res;
+           })
       .def("correct",
            +[](globimap_t &self, size_t x, size_t y, size_t s0,
                size_t s1) -> py::array {
@@ -103,6 +137,13 @@ PYBIND11_MODULE(globimap, m) {
              std::vector<uint32_t> a = {x, y, z, 0};
              self.putp((uint64_t *)&a[0]);
            })
+      .def("put_parallel",
+           +[](globimap_t &self, coords_t coords) {
+             size_t n = coord_count(coords);
+             const uint64_t *data = coords.data();
+             py::gil_scoped_release release;
+             self.put_parallel(data, n);
+           })
       .def("get",
            +[](globimap_t &self, uint32_t x, uint32_t y) -> bool {
              return self.get({x, y});
@@ -112,33 +153,45 @@ PYBIND11_MODULE(globimap, m) {
              std::vector<uint32_t> a = {x, y, z, 0};
              return self.getp((uint64_t *)&a[0]);
            })
+      .def("get_corrected",
+           +[](globimap_t &self, uint32_t x, uint32_t y) -> bool {
+             return self.get_corrected({x, y});
+           })
+      .def("get_many",
+           +[](globimap_t &self, coords_t coords) -> py::array_t<bool> {
+             size_t n = coord_count(coords);
+             py::array_t<bool> res(n);
+             const uint64_t *data = coords.data();
+             bool *out = res.mutable_data();
+             {
+               py::gil_scoped_release release;
+               self.get_many(data, n, out);
+             }
+             return res;
+           })
       .def("configure",
            +[](globimap_t &self, size_t k, size_t m) { self.configure(k, m); })
+      .def("configure",
+           +[](globimap_t &self, size_t k, size_t m, bool blocked) {
+             self.configure(k, m, blocked);
+           })
       .def("clear", +[](globimap_t &self) { self.clear(); })
       .def("summary",
            +[](globimap_t &self) -> std::string { return self.summary(); })
       .def("map",
-           +[](globimap_t &self, py::array mat, int o0, int o1) {
-             map_matrix(mat, [&](int i0, int i1, double v) {
-               if (v != 0 && v != 1) {
-                 std::cout << v << std::endl;
-                 throw(std::runtime_error("data is not binary."));
-               }
-
-               if (v == 1)
-                 self.put({static_cast<uint32_t>(o0 + i0),
-                           static_cast<uint32_t>(o1 + i1)});
+           +[](globimap_t &self, py::array mat, uint32_t o0, uint32_t o1) {
+             with_matrix(mat, [&](const auto *data, uint32_t s0, uint32_t s1,
+                                  ptrdiff_t st0, ptrdiff_t st1) {
+               py::gil_scoped_release release;
+               self.map_matrix(o0, o1, s0, s1, data, st0, st1);
              });
            })
       .def("enforce",
-           +[](globimap_t &self, py::array mat, int o0, int o1) {
-             map_matrix(mat, [&](int i0, int i1, double v) {
-               if (v == 0 && self.get({static_cast<uint32_t>(o0 + i0),
-                                       static_cast<uint32_t>(o1 + i1)})) {
-                 // this is a false positive
-                 self.add_error({static_cast<uint32_t>(o0 + i0),
-                                 static_cast<uint32_t>(o1 + i1)});
-               }
+           +[](globimap_t &self, py::array mat, uint32_t o0, uint32_t o1) {
+             with_matrix(mat, [&](const auto *data, uint32_t s0, uint32_t s1,
+                                  ptrdiff_t st0, ptrdiff_t st1) {
+               py::gil_scoped_release release;
+               self.enforce_matrix(o0, o1, s0, s1, data, st0, st1);
              });
            })
       .def("get_buffer",
@@ -152,7 +205,49 @@ PYBIND11_MODULE(globimap, m) {
            +[](globimap_t &self, py::array_t<uint8_t> buf) -> void {
              self.from_buffer(buf.data(), buf.size(), buf.size() * 8);
            })
-      .def("get_filter", +[](globimap_t &self) { return self.filter; })
+      .def("compact_errors",
+           +[](globimap_t &self) {
+             py::gil_scoped_release release;
+             self.compact_errors();
+           })
+      .def(
+          "build_cascade",
+          +[](globimap_t &self, coords_t positives, double bits_per_key) {
+            size_t n = coord_count(positives);
+            const uint64_t *p = positives.data();
+            py::gil_scoped_release release;
+            self.build_cascade(p, n, bits_per_key);
+          },
+          py::arg("positives"), py::arg("bits_per_key") = 8.0)
+      .def("merge_from",
+           +[](globimap_t &self, const globimap_t &other) {
+             py::gil_scoped_release release;
+             self.merge_from(other);
+           })
+      .def("save",
+           +[](globimap_t &self, const std::string &fn) {
+             py::gil_scoped_release release;
+             self.save(fn);
+           })
+      .def("load",
+           +[](globimap_t &self, const std::string &fn) {
+             py::gil_scoped_release release;
+             self.load(fn);
+           })
+      .def(
+          "map_file",
+          +[](globimap_t &self, const std::string &fn, bool verify) {
+            py::gil_scoped_release release;
+            self.map_file(fn, verify);
+          },
+          py::arg("fn"), py::arg("verify") = false)
+      .def("get_filter",
+           +[](globimap_t &self) {
+             std::vector<uint8_t> f(self.filter.size());
+             for (size_t i = 0; i < f.size(); i++)
+               f[i] = self.filter[i];
+             return f;
+           })
       .def("stats", +[](globimap_t &self) { return self.stats(); })
       // .def("get_filter_np",
       //      +[](globimap_t &self) -> py::array_t<bool> {
@@ -167,4 +262,90 @@ PYBIND11_MODULE(globimap, m) {
         }
         return a;
       });
+
+  // a pixel list hashed once for queries against many counting_globimaps
+  py::class_<globimap::HashedRaster>(m, "hashed_raster")
+      .def(py::init(+[](coords_t coords, uint32_t hash_bits) {
+             size_t n = coord_count(coords);
+             const uint64_t *data = coords.data();
+             py::gil_scoped_release release;
+             return new globimap::HashedRaster(data, n, globimap::H1,
+                                               hash_bits);
+           }),
+           py::arg("coords"), py::arg("hash_bits") = 32)
+      .def("__len__", &globimap::HashedRaster::size)
+      .def("byte_size", &globimap::HashedRaster::byte_size);
+
+  // layers: list of (bits, logsize), bits one of 1, 8, 16, 32, 64
+  py::class_<counting_globimap_t>(m, "counting_globimap")
+      .def(py::init(+[](uint k, std::vector<std::pair<uint, uint>> layers,
+                        bool collect) {
+             globimap::FilterConfig conf{k, {}};
+             for (auto &l : layers) {
+               if (l.first != 1 && l.first != 8 && l.first != 16 &&
+                   l.first != 32 && l.first != 64)
+                 throw(std::runtime_error("bits must be 1, 8, 16, 32 or 64"));
+               conf.layers.push_back({l.first, l.second});
+             }
+             return new counting_globimap_t(conf, collect);
+           }),
+           py::arg("k"), py::arg("layers"), py::arg("collect") = false)
+      .def("put",
+           +[](counting_globimap_t &self, uint64_t x, uint64_t y) {
+             self.put({x, y});
+           })
+      .def("put_many",
+           +[](counting_globimap_t &self, coords_t coords) {
+             size_t n = coord_count(coords);
+             const uint64_t *data = coords.data();
+             py::gil_scoped_release release;
+             self.put_many(data, n);
+           })
+      .def("put_parallel",
+           +[](counting_globimap_t &self, coords_t coords) {
+             size_t n = coord_count(coords);
+             const uint64_t *data = coords.data();
+             py::gil_scoped_release release;
+             self.put_many_parallel(data, n);
+           })
+      .def("get_min",
+           +[](counting_globimap_t &self, uint64_t x, uint64_t y) {
+             return self.get_min({x, y});
+           })
+      .def("get_min_many",
+           +[](counting_globimap_t &self,
+               coords_t coords) -> py::array_t<uint64_t> {
+             size_t n = coord_count(coords);
+             py::array_t<uint64_t> res(n);
+             const uint64_t *data = coords.data();
+             uint64_t *out = res.mutable_data();
+             {
+               py::gil_scoped_release release;
+               self.get_min_many(data, n, out);
+             }
+             return res;
+           })
+      .def("get_sum",
+           +[](counting_globimap_t &self, const globimap::HashedRaster &r) {
+             py::gil_scoped_release release;
+             return self.get_sum(r);
+           })
+      .def("merge_from",
+           +[](counting_globimap_t &self, const counting_globimap_t &other) {
+             py::gil_scoped_release release;
+             self.merge_from(other);
+           })
+      .def("compaction",
+           +[](counting_globimap_t &self) {
+             py::gil_scoped_release release;
+             return self.compaction();
+           })
+      .def("set_track_stats",
+           +[](counting_globimap_t &self, bool on) {
+             py::gil_scoped_release release;
+             self.set_track_stats(on);
+           })
+      .def("summary", +[](counting_globimap_t &self) -> std::string {
+        return self.summary();
+      });
 }
@@ -0,0 +1,133 @@
+/*
+A mergeable streaming quantile sketch for positive integers with bounded
+relative error (log-bucketed, as DDSketch), used for the error magnitudes of
+CountingGloBiMap
+
+A value v >= 1 is counted in bucket ceil(log_gamma(v)) with
+gamma = (1 + alpha) / (1 - alpha); the bucket estimate 2 gamma^i / (gamma + 1)
+is within a relative error alpha of every value in the bucket. Zeros are
+counted apart. Count, sum, min and max are exact. 64 bit values need at most
+about log(2^64) / log(gamma) buckets (2219 for alpha = 0.01), so insert,
+merge and quantile queries cost O(1) / O(buckets) regardless of the number of
+values.
+
+class QuantileSketch:
+    void insert(uint64_t v) / void remove(uint64_t v)
+        count or uncount a value (min and max stay bounds after a remove)
+    void merge(const QuantileSketch &o)
+        add a sketch with the same alpha
+    double quantile(double q)
+        estimate of the value of rank q * (count - 1), 0 <= q <= 1
+    std::vector<double> histogram(size_t buckets)
+        quantile((i + 0.5) / buckets) for every bucket i
+*/
+#ifndef QUANTILE_SKETCH_HPP
+#define QUANTILE_SKETCH_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace globimap {
+
+class QuantileSketch {
+  double alpha;
+  double gamma;
+  double log_gamma;
+  std::vector<uint64_t> counts; ///< bucket i: values in (gamma^(i-1), gamma^i]
+  uint64_t zeros = 0;
+  uint64_t n = 0;
+  uint64_t total = 0;
+  uint64_t lo = UINT64_MAX, hi = 0;
+
+  size_t bucket(uint64_t v) const {
+    return static_cast<size_t>(
+        std::max(0.0, std::ceil(std::log(static_cast<double>(v)) / log_gamma)));
+  }
+
+public:
+  explicit QuantileSketch(double alpha = 0.01)
+      : alpha(alpha), gamma((1 + alpha) / (1 - alpha)),
+        log_gamma(std::log(gamma)) {}
+
+  void insert(uint64_t v) {
+    if (v == 0) {
+      zeros++;
+    } else {
+      size_t b = bucket(v);
+      if (b >= counts.size())
+        counts.resize(b + 1, 0);
+      counts[b]++;
+    }
+    n++;
+    total += v;
+    lo = std::min(lo, v);
+    hi = std::max(hi, v);
+  }
+  void remove(uint64_t v) {
+    if (v == 0) {
+      if (zeros == 0)
+        return;
+      zeros--;
+    } else {
+      size_t b = bucket(v);
+      if (b >= counts.size() || counts[b] == 0)
+        return;
+      counts[b]--;
+    }
+    n--;
+    total -= v;
+  }
+
+  void merge(const QuantileSketch &o) {
+    if (o.alpha != alpha)
+      throw(std::runtime_error("merge needs sketches with the same alpha"));
+    if (o.counts.size() > counts.size())
+      counts.resize(o.counts.size(), 0);
+    for (size_t i = 0; i < o.counts.size(); i++)
+      counts[i] += o.counts[i];
+    zeros += o.zeros;
+    n += o.n;
+    total += o.total;
+    lo = std::min(lo, o.lo);
+    hi = std::max(hi, o.hi);
+  }
+
+  void clear() { *this = QuantileSketch(alpha); }
+
+  uint64_t count() const { return n; }
+  uint64_t sum() const { return total; }
+  uint64_t min() const { return lo; }
+  uint64_t max() const { return hi; }
+  double mean() const { return n == 0 ? 0 : (double)total / (double)n; }
+
+  double quantile(double q) const {
+    if (n == 0)
+      return 0;
+    uint64_t rank = static_cast<uint64_t>(q * (n - 1));
+    if (rank < zeros)
+      return 0;
+    uint64_t seen = zeros;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (rank < seen) {
+        double v = 2 * std::pow(gamma, static_cast<double>(i)) / (gamma + 1);
+        return std::min(std::max(v, (double)lo), (double)hi);
+      }
+    }
+    return hi;
+  }
+
+  std::vector<double> histogram(size_t buckets) const {
+    std::vector<double> h(buckets, 0);
+    for (size_t i = 0; i < buckets && n > 0; i++)
+      h[i] = quantile((i + 0.5) / buckets);
+    return h;
+  }
+};
+
+} // namespace globimap
+
+#endif
@@ -0,0 +1,909 @@
+/*
+Behaviour checks of the C++ headers: every fast path is compared against the
+scalar (baseline) path it replaces, formats are checked by round trips.
+
+Build target globimap_tests (run by ctest), or without the build system:
+    g++ -O0 -std=c++17 -fopenmp -I. tests/globimap_test.cpp
+A failing check prints its location, the exit code is the number of failed
+tests.
+*/
+#include "globimap/counting_globimap.hpp"
+#include "globimap/globimap.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <string.h>
+#include <unistd.h>
+
+using namespace globimap;
+
+static std::vector<std::pair<std::string, std::function<void()>>> &tests() {
+  static std::vector<std::pair<std::string, std::function<void()>>> t;
+  return t;
+}
+static bool test_failed = false;
+
+struct Register {
+  Register(const char *name, std::function<void()> f) {
+    tests().push_back({name, f});
+  }
+};
+#define TEST(name)                                                             \
+  static void name();                                                          \
+  static Register register_##name(#name, name);                                \
+  static void name()
+
+#define CHECK(c)                                                               \
+  do {                                                                         \
+    if (!(c)) {                                                                \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #c ") failed"     \
+                << std::endl;                                                  \
+      test_failed = true;                                                      \
+    }                                                                          \
+  } while (0)
+
+// n random pixels x0, y0, x1, y1, ... in [0, side)^2
+static std::vector<uint64_t> random_points(size_t n, uint64_t side,
+                                           uint64_t seed = 1) {
+  std::mt19937_64 g(seed);
+  std::vector<uint64_t> p(2 * n);
+  for (auto &v : p)
+    v = g() % side;
+  return p;
+}
+
+TEST(packed_bitset_matches_bool_storage) {
+  GloBiMap<bool> a;
+  GloBiMap<packed_bit> b;
+  a.configure(4, 16);
+  b.configure(4, 16);
+  auto p = random_points(5000, 1000);
+  for (size_t i = 0; i < p.size(); i += 2) {
+    a.put({p[i], p[i + 1]});
+    b.put({p[i], p[i + 1]});
+  }
+  for (uint64_t x = 0; x < 200; x++)
+    for (uint64_t y = 0; y < 200; y++)
+      CHECK(a.get({x, y}) == b.get({x, y}));
+  std::string ba, bb;
+  a.tobuffer(ba);
+  b.tobuffer(bb);
+  CHECK(ba == bb);
+}
+
+TEST(parallel_put_matches_sequential) {
+  auto p = random_points(20000, 5000);
+  GloBiMap<bool> seq;
+  GloBiMap<packed_bit> par;
+  seq.configure(4, 18);
+  par.configure(4, 18);
+  for (size_t i = 0; i < p.size(); i += 2)
+    seq.putp(&p[i]);
+#pragma omp parallel for
+  for (size_t i = 0; i < p.size(); i += 2)
+    par.putp(&p[i]);
+  std::string a, b;
+  seq.tobuffer(a);
+  par.tobuffer(b);
+  CHECK(a == b);
+}
+
+TEST(blocked_fill_estimate_matches_bool_storage) {
+  // logm 4 to 10: blocks smaller than, equal to and larger than a word
+  for (size_t logm = 4; logm <= 10; logm++) {
+    GloBiMap<bool> a;
+    GloBiMap<packed_bit> b;
+    a.configure(3, logm, true);
+    b.configure(3, logm, true);
+    auto p = random_points(1 << (logm - 3), 100, logm);
+    for (size_t i = 0; i < p.size(); i += 2) {
+      a.putp(&p[i]);
+      b.putp(&p[i]);
+    }
+    CHECK(std::get<0>(a.fpr_estimate()) == std::get<0>(b.fpr_estimate()));
+  }
+}
+
+TEST(batched_put_get_match_single_pixel_calls) {
+  auto p = random_points(20000, 3000);
+  GloBiMap<packed_bit> a, b;
+  a.configure(4, 18);
+  b.configure(4, 18);
+  for (size_t i = 0; i < p.size(); i += 2)
+    a.putp(&p[i]);
+  b.put_many(p.data(), p.size() / 2);
+  auto q = random_points(20000, 3000, 2);
+  std::unique_ptr<bool[]> out(new bool[q.size() / 2]);
+  b.get_many(q.data(), q.size() / 2, out.get());
+  for (size_t i = 0; i < q.size(); i += 2)
+    CHECK(out[i / 2] == a.getp(&q[i]));
+
+  typedef CountingGloBiMap<> M;
+  M c(FilterConfig{4, {{8, 12}, {16, 14}}}, true);
+  M d(FilterConfig{4, {{8, 12}, {16, 14}}}, true);
+  for (size_t i = 0; i < p.size(); i += 2)
+    c.putp(&p[i]);
+  d.put_many(p.data(), p.size() / 2);
+  for (size_t i = 0; i < q.size(); i += 2)
+    CHECK(c.get_min({q[i], q[i + 1]}) == d.get_min({q[i], q[i + 1]}));
+}
+
+TEST(hash_many_matches_hash16) {
+  // every remainder of the 4 / 8 wide SIMD batches
+  for (size_t n = 0; n < 40; n++) {
+    auto p = random_points(n, UINT64_MAX, n);
+    std::vector<uint64_t> hs(2 * n);
+    hash_many(p.data(), n, hs.data(), 8589845122);
+    for (size_t i = 0; i < n; i++) {
+      uint64_t h1 = 8589845122, h2 = 0;
+      hash16(&p[2 * i], &h1, &h2);
+      CHECK(hs[2 * i] == h1 && hs[2 * i + 1] == h2);
+    }
+  }
+  // and hash16 with a 32 bit seed is the reference MurmurHash3
+  auto p = random_points(100, UINT64_MAX);
+  for (size_t i = 0; i < p.size(); i += 2) {
+    uint64_t ref[2], h1 = 12345, h2 = 0;
+    murmur::MurmurHash3_x64_128(&p[i], 16, 12345, ref);
+    hash16(&p[i], &h1, &h2);
+    CHECK(ref[0] == h1 && ref[1] == h2);
+  }
+}
+
+// hot pixels (every fifth point is one of 10) saturate the lower layers
+static std::vector<uint64_t> skewed_points(size_t n, uint64_t side,
+                                           uint64_t seed = 1) {
+  auto p = random_points(n, side, seed);
+  for (size_t i = 0; i < n; i += 5) {
+    p[2 * i] = i % 10;
+    p[2 * i + 1] = 7;
+  }
+  return p;
+}
+
+TEST(fixed_kernels_match_generic_loops) {
+  GloBiMap<bool, 4> a;
+  GloBiMap<bool> b;
+  a.configure(4, 16);
+  b.configure(4, 16);
+  auto p = random_points(5000, 1000);
+  a.put_many(p.data(), p.size() / 2);
+  b.put_many(p.data(), p.size() / 2);
+  std::string ba, bb;
+  a.tobuffer(ba);
+  b.tobuffer(bb);
+  CHECK(ba == bb);
+
+  typedef CountingGloBiMap<> M;
+  p = skewed_points(50000, 300);
+  M c(FilterConfig{8, {{8, 10}, {16, 12}}});
+  M d(FilterConfig{8, {{8, 10}, {16, 12}}});
+  CHECK(c.specialized);
+  d.put_kernel = &M::put_generic;
+  d.get_min_kernel = &M::get_min_generic;
+  c.put_all(p);
+  d.put_all(p);
+  for (uint64_t x = 0; x < 300; x++)
+    for (uint64_t y = 0; y < 20; y++)
+      CHECK(c.get_min({x, y}) == d.get_min({x, y}));
+}
+
+TEST(tiled_rasterize_matches_get) {
+  GloBiMap<packed_bit> m;
+  m.configure(2, 14);
+  auto p = random_points(3000, 200);
+  m.put_many(p.data(), p.size() / 2);
+  // sizes that are not multiples of the tile size
+  uint32_t s0 = 150, s1 = 131;
+  std::vector<uint8_t> bytes(s0 * s1);
+  std::vector<uint64_t> packed(s0 * m.packed_row_words(s1));
+  m.rasterize_into(10, 20, s0, s1, bytes.data());
+  m.rasterize_packed(10, 20, s0, s1, packed.data());
+  auto &doubles = m.rasterize(10, 20, s0, s1);
+  for (uint32_t i = 0; i < s0; i++)
+    for (uint32_t j = 0; j < s1; j++) {
+      bool v = m.get({10 + i, 20 + j});
+      CHECK(bytes[i * s1 + j] == v);
+      CHECK(doubles[i * s1 + j] == v);
+      CHECK(((packed[i * m.packed_row_words(s1) + j / 64] >> (j % 64)) & 1) ==
+            v);
+    }
+}
+
+TEST(morton_window_query_matches_scan) {
+  MortonIndex idx;
+  std::set<std::pair<uint32_t, uint32_t>> ref;
+  std::mt19937_64 g(3);
+  auto check_windows = [&]() {
+    for (int w = 0; w < 50; w++) {
+      uint32_t x0 = g() % 500, y0 = g() % 500;
+      uint32_t x1 = x0 + g() % 100, y1 = y0 + g() % 100;
+      std::set<std::pair<uint32_t, uint32_t>> got, want;
+      idx.for_each_in(x0, y0, x1, y1,
+                      [&](uint32_t x, uint32_t y) { got.insert({x, y}); });
+      for (auto &e : ref)
+        if (e.first >= x0 && e.first <= x1 && e.second >= y0 &&
+            e.second <= y1)
+          want.insert(e);
+      CHECK(got == want);
+    }
+    CHECK(idx.size() == ref.size());
+  };
+  for (int i = 0; i < 3000; i++) {
+    uint32_t x = g() % 500, y = g() % 500;
+    idx.insert(x, y);
+    ref.insert({x, y});
+  }
+  check_windows();
+  idx.compact();
+  CHECK(idx.compacted());
+  check_windows();
+  idx.insert(1, 1); // decodes the compacted codes again
+  ref.insert({1, 1});
+  check_windows();
+}
+
+TEST(concurrent_corrected_reads_after_add_error) {
+  GloBiMap<packed_bit> m;
+  m.configure(2, 12);
+  auto p = random_points(2000, 200);
+  m.put_many(p.data(), p.size() / 2);
+  std::set<std::pair<uint64_t, uint64_t>> errors;
+  for (size_t i = 0; i < 400; i += 2) {
+    m.add_error({(uint32_t)p[i], (uint32_t)p[i + 1]});
+    errors.insert({p[i], p[i + 1]});
+  }
+  // the first queries run concurrently and merge the pending inserts
+  std::vector<int> got(200 * 200);
+#pragma omp parallel for
+  for (uint64_t x = 0; x < 200; x++)
+    for (uint64_t y = 0; y < 200; y++)
+      got[x * 200 + y] = m.get_corrected({x, y});
+  for (uint64_t x = 0; x < 200; x++)
+    for (uint64_t y = 0; y < 200; y++)
+      CHECK(got[x * 200 + y] == (m.get({x, y}) && !errors.count({x, y})));
+}
+
+// same filter bits, same corrections
+template <typename A, typename B> static bool same_map(A &a, B &b) {
+  std::string ba, bb;
+  a.tobuffer(ba);
+  b.tobuffer(bb);
+  bool same = ba == bb;
+  for (uint64_t x = 0; x < 100; x++)
+    for (uint64_t y = 0; y < 100; y++)
+      same = same && a.get_corrected({x, y}) == b.get_corrected({x, y});
+  return same;
+}
+
+TEST(save_load_round_trip) {
+  for (bool blocked : {false, true}) {
+    GloBiMap<bool> a;
+    a.configure(3, 15, blocked);
+    auto p = random_points(3000, 100);
+    a.put_many(p.data(), p.size() / 2);
+    for (size_t i = 0; i < 200; i += 2)
+      a.add_error({(uint32_t)p[i], (uint32_t)p[i + 1]});
+    std::stringstream ss;
+    a.save(ss);
+    GloBiMap<bool> b;
+    GloBiMap<packed_bit> c;
+    b.load(ss);
+    ss.seekg(0);
+    c.load(ss);
+    CHECK(same_map(a, b));
+    CHECK(same_map(a, c));
+
+    std::string bytes = ss.str();
+    bytes[bytes.size() / 2] ^= 1;
+    std::stringstream bad(bytes);
+    bool thrown = false;
+    try {
+      b.load(bad);
+    } catch (std::runtime_error &) {
+      thrown = true;
+    }
+    CHECK(thrown);
+  }
+}
+
+// true if f throws std::runtime_error
+template <typename F> static bool throws(F f) {
+  try {
+    f();
+  } catch (std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+TEST(map_file_matches_load_and_rejects_bad_headers) {
+  std::string fn = "globimap_test_" + std::to_string(getpid()) + ".bin";
+  GloBiMap<packed_bit> a, b, c;
+  a.configure(3, 15);
+  auto p = random_points(3000, 100);
+  a.put_many(p.data(), p.size() / 2);
+  for (size_t i = 0; i < 200; i += 2)
+    a.add_error({(uint32_t)p[i], (uint32_t)p[i + 1]});
+  a.save(fn);
+  b.map_file(fn, true);
+  c.load(fn);
+  CHECK(same_map(a, b));
+  CHECK(same_map(a, c));
+
+  // headers from a file are not trusted: huge sizes must not be allocated
+  std::stringstream ss;
+  a.save(ss);
+  std::string good = ss.str();
+  FileHeader h;
+  for (int field = 0; field < 4; field++) {
+    memcpy(&h, good.data(), sizeof(h));
+    if (field == 0)
+      h.logm = 40;
+    else if (field == 1)
+      h.logm = 200;
+    else if (field == 2)
+      h.errors = UINT64_MAX / 4;
+    else
+      h.errors = good.size();
+    std::string bad = good;
+    memcpy(&bad[0], &h, sizeof(h));
+    std::stringstream is(bad);
+    CHECK(throws([&]() { c.load(is); }));
+    std::ofstream(fn, std::ios::binary) << bad;
+    CHECK(throws([&]() { b.map_file(fn); }));
+  }
+
+  // consistent checksums: a k that would loop forever, a k other than the
+  // compiled K and error codes that are not strictly increasing
+  size_t words = (good.size() - sizeof(h)) / 8;
+  for (int field = 0; field < 4; field++) {
+    std::string bad = good;
+    memcpy(&h, bad.data(), sizeof(h));
+    uint64_t *w = reinterpret_cast<uint64_t *>(&bad[sizeof(h)]);
+    if (field == 0)
+      h.k = 3000000000u;
+    else if (field == 1)
+      h.k = 65;
+    else if (field == 2)
+      std::swap(w[h.words], w[h.words + 1]);
+    else
+      w[h.words + 1] = w[h.words];
+    h.checksum = checksum64(w + h.words, h.errors, checksum64(w, h.words));
+    memcpy(&bad[0], &h, sizeof(h));
+    std::stringstream is(bad);
+    CHECK(throws([&]() { c.load(is); }));
+    std::ofstream(fn, std::ios::binary) << bad;
+    CHECK(throws([&]() { b.map_file(fn); }));
+  }
+  CHECK(words > h.words + 1);
+  // a failed map_file leaves the map as it was
+  CHECK(same_map(a, b));
+  a.save(fn);
+  GloBiMap<packed_bit, 4> k4;
+  k4.configure(4, 10);
+  CHECK(throws([&]() { k4.map_file(fn); }));
+  CHECK(k4.get({1, 1}) == false);
+
+  // the mapping is read-only; configure takes a private copy
+  CHECK(throws([&]() { b.put({1, 1}); }));
+  CHECK(throws([&]() { b.put_many(p.data(), 1); }));
+  CHECK(throws([&]() { b.merge_from(a); }));
+  b.configure(3, 15);
+  CHECK(same_map(a, b));
+  b.put({1, 1});
+  CHECK(b.get({1, 1}));
+  unlink(fn.c_str());
+}
+
+typedef CountingGloBiMap<> CM;
+
+// layer sizes that do not grow (the overflow of a counter goes to the same
+// next-layer counter for every probe) and that grow (experiments/config.json)
+static const FilterConfig shrinking = {4, {{8, 12}, {16, 10}, {32, 10}}};
+static const FilterConfig growing = {4, {{8, 10}, {16, 14}, {32, 18}}};
+
+static void check_same_counts(CM &a, CM &b, uint64_t side) {
+  for (uint64_t x = 0; x < side; x++)
+    for (uint64_t y = 0; y < side; y++)
+      CHECK(a.get_min({x, y}) == b.get_min({x, y}));
+}
+// no pixel reads less than it was put
+static void check_no_undercount(CM &m, const std::vector<uint64_t> &p) {
+  std::map<std::pair<uint64_t, uint64_t>, uint64_t> truth;
+  for (size_t i = 0; i < p.size(); i += 2)
+    truth[{p[i], p[i + 1]}]++;
+  for (auto &t : truth)
+    CHECK(m.get_min({t.first.first, t.first.second}) >= t.second);
+}
+
+TEST(atomic_parallel_put_matches_sequential) {
+  auto p = skewed_points(200000, 300);
+  CM a(shrinking), b(shrinking);
+  a.put_all(p);
+  b.put_all_parallel(p);
+  check_same_counts(a, b, 300);
+  // with growing layers the order decides which probe overflows
+  CM c(growing);
+  c.put_all_parallel(p);
+  check_no_undercount(c, p);
+  // 1 bit layer 0, set with atomic fetch-or on shared words
+  FilterConfig bits1 = {4, {{1, 14}, {8, 12}, {16, 10}}};
+  CM d(bits1), e(bits1);
+  d.put_all(p);
+  e.put_all_parallel(p);
+  check_same_counts(d, e, 300);
+  CHECK(d.layers[0].stats().sum == e.layers[0].stats().sum);
+}
+
+TEST(sharded_put_and_merge_match_sequential) {
+  auto p = skewed_points(200000, 300);
+  size_t half = p.size() / 4 * 2;
+  std::vector<uint64_t> p0(p.begin(), p.begin() + half),
+      p1(p.begin() + half, p.end());
+  CM seq(shrinking), sharded(shrinking), a(shrinking), b(shrinking);
+  seq.put_all(p);
+  sharded.put_all_sharded(p);
+  a.put_all(p0);
+  b.put_all(p1);
+  a.merge_from(b);
+  check_same_counts(seq, sharded, 300);
+  check_same_counts(seq, a, 300);
+
+  // growing layers: the counts of a shard do not tell which next-layer
+  // counter the excess of a counter belongs to
+  CM gseq(growing), gsharded(growing), ga(growing), gb(growing);
+  gseq.put_all(p);
+  ga.put_all(p0);
+  gb.put_all(p1);
+  CHECK(throws([&]() { ga.merge_from(gb); }));
+  gsharded.put_all_sharded(p);
+  check_no_undercount(gsharded, p);
+  // which probe overflows depends on the order, in one thread it is the
+  // sequential one
+  int threads = omp_get_max_threads();
+  omp_set_num_threads(1);
+  CM gone(growing);
+  gone.put_all_sharded(p);
+  omp_set_num_threads(threads);
+  check_same_counts(gseq, gone, 300);
+}
+
+TEST(globimap_merge_matches_union) {
+  auto p0 = random_points(3000, 150, 4), p1 = random_points(3000, 150, 5);
+  GloBiMap<packed_bit> a, b, u;
+  for (auto *m : {&a, &b, &u})
+    m->configure(3, 14);
+  a.put_many(p0.data(), p0.size() / 2);
+  b.put_many(p1.data(), p1.size() / 2);
+  u.put_many(p0.data(), p0.size() / 2);
+  u.put_many(p1.data(), p1.size() / 2);
+  // an error of a that b has set is no error of the union
+  for (uint64_t x = 0; x < 150; x++)
+    for (uint64_t y = 0; y < 150; y++)
+      if (a.get({x, y}) && (x + y) % 3 == 0)
+        a.add_error({(uint32_t)x, (uint32_t)y});
+  GloBiMap<packed_bit> before = a;
+  a.merge_from(b);
+  std::string ba, bu;
+  a.tobuffer(ba);
+  u.tobuffer(bu);
+  CHECK(ba == bu);
+  for (uint64_t x = 0; x < 150; x++)
+    for (uint64_t y = 0; y < 150; y++) {
+      bool error_before = before.get({x, y}) && !before.get_corrected({x, y});
+      bool in_b = b.get({x, y});
+      CHECK(a.get_corrected({x, y}) ==
+            (u.get({x, y}) && !(error_before && !in_b)));
+    }
+}
+
+// get_min_many and get_sum against get_min on every pixel of a side^2 grid
+static void check_batched_min(CM &m, uint64_t side) {
+  std::vector<uint64_t> grid;
+  for (uint64_t x = 0; x < side; x++)
+    for (uint64_t y = 0; y < side; y++) {
+      grid.push_back(x);
+      grid.push_back(y);
+    }
+  std::vector<uint64_t> got(grid.size() / 2);
+  m.get_min_many(grid.data(), got.size(), got.data());
+  uint64_t sum = 0;
+  for (size_t j = 0; j < got.size(); j++) {
+    uint64_t want = m.get_min({grid[2 * j], grid[2 * j + 1]});
+    CHECK(got[j] == want);
+    sum += want;
+  }
+  CHECK(m.get_sum(HashedRaster(grid)) == sum);
+}
+
+TEST(batched_get_min_matches_get_min) {
+  // one probe saturated in layer 0 with a zero counter behind it, the
+  // other probe below the threshold: get_min is 0
+  CM m(FilterConfig{2, {{8, 10}, {16, 12}}});
+  uint64_t pt[2] = {3, 4}, hs[2];
+  hash_many(pt, 1, hs, H1);
+  uint64_t mask = m.layers[0].mask;
+  uint64_t p0 = (hs[0] + hs[1]) & mask, p1 = (hs[0] + 2 * hs[1]) & mask;
+  CHECK(p0 != p1);
+  m.layers[0].visit([&](auto &f, auto) {
+    f[p0] = 255;
+    f[p1] = 5;
+  });
+  uint64_t got;
+  m.get_min_many(pt, 1, &got);
+  CHECK(m.get_min({3, 4}) == 0);
+  CHECK(got == 0);
+
+  auto p = skewed_points(100000, 200);
+  for (auto conf : {shrinking, growing, FilterConfig{3, {{1, 14}, {8, 12}}},
+                    FilterConfig{8, {{8, 10}, {16, 12}}}}) {
+    CM c(conf);
+    c.put_all(p);
+    check_batched_min(c, 200);
+  }
+}
+
+TEST(hashed_raster_compact_and_wide_agree) {
+  auto p = skewed_points(100000, 200);
+  CM m(growing);
+  m.put_all(p);
+  auto q = random_points(5000, 220, 7);
+  HashedRaster narrow(q), wide(q, H1, 64);
+  CHECK(narrow.byte_size() == 8 * narrow.size());
+  CHECK(wide.byte_size() == 16 * wide.size());
+  uint64_t sum = 0;
+  for (size_t i = 0; i < q.size(); i += 2)
+    sum += m.get_min({q[i], q[i + 1]});
+  CHECK(m.get_sum(narrow) == sum);
+  CHECK(m.get_sum(wide) == sum);
+  std::vector<uint64_t> a(narrow.size()), b(wide.size());
+  m.get_min_many(narrow, a.data());
+  m.get_min_many(wide, b.data());
+  CHECK(a == b);
+  // a layer of more than 2^32 counters reads hash bits a 32 bit raster
+  // does not keep
+  m.layers.back().mask = (uint64_t{1} << 33) - 1;
+  CHECK(throws([&]() { m.get_sum(narrow); }));
+}
+
+TEST(compaction_keeps_counts_and_is_read_only) {
+  auto p = skewed_points(100000, 200);
+  CM m(FilterConfig{4, {{8, 16}, {16, 16}, {32, 20}, {64, 20}}});
+  m.put_all(p);
+  std::vector<uint64_t> before;
+  for (uint64_t x = 0; x < 200; x++)
+    for (uint64_t y = 0; y < 200; y++)
+      before.push_back(m.get_min({x, y}));
+  CHECK(m.compaction() > 0);
+  CHECK(m.layers.size() < 4);
+  size_t i = 0;
+  for (uint64_t x = 0; x < 200; x++)
+    for (uint64_t y = 0; y < 200; y++, i++)
+      if (before[i] != 0) // see compaction: zero reads may change
+        CHECK(m.get_min({x, y}) == before[i]);
+  CHECK(throws([&]() { m.put({1, 2}); }));
+  CHECK(throws([&]() { m.put_all(p); }));
+  CHECK(throws([&]() { m.put_all_parallel(p); }));
+
+  CM empty(FilterConfig{4, {}});
+  CHECK(empty.compaction() == 0);
+}
+
+TEST(tracked_layer_stats_match_scan) {
+  auto p = skewed_points(100000, 300);
+  for (bool parallel : {false, true}) {
+    CM m(FilterConfig{4, {{1, 16}, {8, 12}, {16, 10}}});
+    m.set_track_stats(true);
+    if (parallel)
+      m.put_all_parallel(p);
+    else
+      m.put_all(p);
+    for (auto &l : m.layers) {
+      auto t = l.tracked_stats(), s = l.stats();
+      CHECK(t.zeros == s.zeros && t.min == s.min && t.max == s.max &&
+            t.sum == s.sum);
+    }
+  }
+}
+
+// detect_errors pixel by pixel, as before the tiling
+static std::map<uint64_t, uint64_t>
+scan_errors(CM &m, const std::map<uint64_t, uint64_t> &truth, uint64_t x0,
+            uint64_t y0, uint64_t w, uint64_t h) {
+  std::map<uint64_t, uint64_t> e;
+  for (uint64_t x = x0; x < x0 + w; x++)
+    for (uint64_t y = y0; y < y0 + h; y++) {
+      auto it = truth.find(CoordMap::key(x, y));
+      uint64_t count = it == truth.end() ? 0 : it->second;
+      if (count == 0) {
+        if (m.get_bool({x, y}))
+          e[CoordMap::key(x, y)] = 1;
+        continue;
+      }
+      uint64_t g = m.get_min({x, y});
+      uint64_t d = g > count ? g - count : count - g;
+      if (d != 0)
+        e[CoordMap::key(x, y)] = d;
+    }
+  return e;
+}
+static std::map<uint64_t, uint64_t> dump(const CoordMap &c) {
+  std::map<uint64_t, uint64_t> d;
+  c.for_each([&](uint64_t k, uint32_t v) { d[k] = v; });
+  return d;
+}
+
+TEST(tiled_detect_errors_matches_pixel_scan) {
+  auto p = skewed_points(60000, 700);
+  CM m(FilterConfig{3, {{8, 14}, {16, 12}}}, true);
+  m.put_all(p);
+  auto truth = dump(m.counter);
+  auto want = scan_errors(m, truth, 13, 7, 600, 650);
+  m.detect_errors(13, 7, 600, 650);
+  CHECK(dump(m.errors) == want);
+  CHECK(m.error_rate == (double)want.size() / (600.0 * 650.0));
+}
+
+TEST(coord_map_matches_std_map) {
+  CoordMap c;
+  std::map<uint64_t, uint64_t> ref;
+  std::mt19937_64 g(9);
+  // few distinct keys in a small table: long probe chains, many erases
+  for (int i = 0; i < 200000; i++) {
+    uint64_t k = CoordMap::key(g() % 64, g() % 64);
+    switch (g() % 4) {
+    case 0:
+      c.add(k, 3);
+      ref[k] += 3;
+      break;
+    case 1:
+      c.set(k, 7);
+      ref[k] = 7;
+      break;
+    case 2:
+      c.set(k, 0);
+      ref.erase(k);
+      break;
+    default:
+      c.erase(k);
+      ref.erase(k);
+    }
+  }
+  CHECK(dump(c) == ref);
+  CHECK(c.size() == ref.size());
+  for (uint64_t x = 0; x < 64; x++)
+    for (uint64_t y = 0; y < 64; y++) {
+      auto it = ref.find(CoordMap::key(x, y));
+      CHECK(c.get(CoordMap::key(x, y)) == (it == ref.end() ? 0 : it->second));
+    }
+  // counts saturate instead of wrapping
+  c.set(1, uint64_t{1} << 40);
+  CHECK(c.get(1) == UINT32_MAX);
+  c.set(2, UINT32_MAX - 1);
+  c.add(2, 5);
+  CHECK(c.get(2) == UINT32_MAX);
+}
+
+// a fresh directory for spill files
+static std::string temp_dir() {
+  char d[] = "/tmp/globimap_test_XXXXXX";
+  return mkdtemp(d) ? d : "/tmp";
+}
+
+TEST(external_counter_matches_coord_map) {
+  std::string dir = temp_dir();
+  {
+    std::map<uint64_t, uint64_t> ref;
+    // 100 records per run: hundreds of runs, merged in several passes
+    ExternalCounter e(dir, 100);
+    auto p = skewed_points(50000, 3000);
+    for (size_t i = 0; i < p.size(); i += 2) {
+      uint64_t code = morton2(p[i], p[i + 1]);
+      e.add(code, 1 + i % 3);
+      ref[code] += 1 + i % 3;
+    }
+    std::map<uint64_t, uint64_t> unsorted;
+    e.for_each_unsorted([&](uint64_t c, uint64_t v) { unsorted[c] += v; });
+    CHECK(unsorted == ref);
+
+    ExternalCounter copy(e);
+    copy.add(morton2(1, 1), 5);
+    e.finish();
+    std::map<uint64_t, uint64_t> got;
+    e.for_each([&](uint64_t c, uint64_t v) { got[c] += v; });
+    CHECK(got == ref);
+    CHECK(e.size() == ref.size());
+    std::vector<uint64_t> codes;
+    uint64_t want = 0;
+    for (uint64_t x = 0; x < 3000; x += 7) {
+      uint64_t c = morton2(x, x / 2);
+      auto it = ref.find(c);
+      CHECK(e.get(c) == (it == ref.end() ? 0 : it->second));
+      codes.push_back(c);
+      want += it == ref.end() ? 0 : it->second;
+    }
+    CHECK(e.sum_of(codes) == want);
+    std::vector<ExternalCounter::Record> r;
+    e.range(1000, 900000, r);
+    auto lo = ref.lower_bound(1000), hi = ref.upper_bound(900000);
+    CHECK(r.size() == (size_t)std::distance(lo, hi));
+    for (size_t i = 0; i < r.size() && lo != hi; i++, ++lo)
+      CHECK(r[i].code == lo->first && r[i].count == lo->second);
+
+    // the copy owns its files: unchanged by finish on e, and the reverse
+    ref[morton2(1, 1)] += 5;
+    copy.finish();
+    got.clear();
+    copy.for_each([&](uint64_t c, uint64_t v) { got[c] += v; });
+    CHECK(got == ref);
+    e.clear();
+    CHECK(copy.get(morton2(1, 1)) == ref[morton2(1, 1)]);
+    // a second finish merges into the previous result
+    copy.add(morton2(1, 1), 1);
+    copy.finish();
+    CHECK(copy.get(morton2(1, 1)) == ref[morton2(1, 1)] + 1);
+  }
+  CHECK(rmdir(dir.c_str()) == 0); // no run file left behind
+}
+
+TEST(collect_to_disk_matches_in_memory) {
+  std::string dir = temp_dir();
+  {
+    auto p = skewed_points(40000, 500);
+    CM mem(shrinking, true), disk(shrinking, true);
+    disk.collect_to_disk(dir, 500);
+    mem.put_all(p);
+    disk.put_all_sharded(p);
+    CM copy(disk);
+    CHECK(disk.get_sum_raster_collected(p) == mem.get_sum_raster_collected(p));
+    mem.detect_errors(0, 0, 500, 500);
+    disk.detect_errors(0, 0, 500, 500);
+    CHECK(dump(disk.errors) == dump(mem.errors));
+    // the copy keeps its collected input after disk cleared its own
+    CHECK(copy.has_collected());
+    copy.detect_errors(0, 0, 500, 500);
+    CHECK(dump(copy.errors) == dump(mem.errors));
+    // merging a spilled map adds its collected counts
+    CM a(shrinking, true), b(shrinking, true);
+    a.collect_to_disk(dir, 300);
+    b.collect_to_disk(dir, 300);
+    a.put_all(std::vector<uint64_t>(p.begin(), p.begin() + p.size() / 2));
+    b.put_all(std::vector<uint64_t>(p.begin() + p.size() / 2, p.end()));
+    a.merge_from(b);
+    a.detect_errors(0, 0, 500, 500);
+    CHECK(dump(a.errors) == dump(mem.errors));
+  }
+  CHECK(rmdir(dir.c_str()) == 0);
+}
+
+TEST(cascade_matches_explicit_errors) {
+  GloBiMap<packed_bit> list, cas;
+  list.configure(2, 12);
+  cas.configure(2, 12);
+  auto p = random_points(2000, 200);
+  list.put_many(p.data(), p.size() / 2);
+  cas.put_many(p.data(), p.size() / 2);
+  std::set<std::pair<uint64_t, uint64_t>> truth;
+  for (size_t i = 0; i < p.size(); i += 2)
+    truth.insert({p[i], p[i + 1]});
+  for (uint64_t x = 0; x < 200; x++)
+    for (uint64_t y = 0; y < 200; y++)
+      if (list.get({x, y}) && !truth.count({x, y})) {
+        list.add_error({(uint32_t)x, (uint32_t)y});
+        cas.add_error({(uint32_t)x, (uint32_t)y});
+      }
+  cas.build_cascade(p.data(), p.size() / 2, 6);
+  // every pixel of the region is an error or a positive (or not in the
+  // filter), so the cascade classifies all of them exactly
+  for (uint64_t x = 0; x < 200; x++)
+    for (uint64_t y = 0; y < 200; y++)
+      CHECK(cas.get_corrected({x, y}) == list.get_corrected({x, y}));
+  // a second cascade would lose the first one's errors: it throws, errors
+  // added later stay in the list
+  uint64_t ex = 200, ey = 0;
+  while (!list.get({ex, ey}))
+    ey++;
+  list.add_error({(uint32_t)ex, (uint32_t)ey});
+  cas.add_error({(uint32_t)ex, (uint32_t)ey});
+  CHECK(throws([&] { cas.build_cascade(p.data(), p.size() / 2, 6); }));
+  CHECK(!cas.get_corrected({ex, ey}));
+  for (uint64_t x = 0; x < 200; x++)
+    for (uint64_t y = 0; y < 200; y++)
+      CHECK(cas.get_corrected({x, y}) == list.get_corrected({x, y}));
+}
+
+TEST(quantile_sketch_matches_sorted_values) {
+  std::mt19937_64 g(5);
+  std::vector<uint64_t> v;
+  QuantileSketch a, b;
+  for (int i = 0; i < 20000; i++) {
+    uint64_t x = g() % 4 == 0 ? 0 : 1 + (g() % 1000) * (g() % 1000);
+    v.push_back(x);
+    (i % 2 ? a : b).insert(x);
+  }
+  a.merge(b);
+  std::sort(v.begin(), v.end());
+  CHECK(a.count() == v.size());
+  CHECK(a.min() == v.front() && a.max() == v.back());
+  for (double q : {0.0, 0.1, 0.25, 0.5, 0.9, 0.99, 1.0}) {
+    double want = v[static_cast<size_t>(q * (v.size() - 1))];
+    CHECK(std::abs(a.quantile(q) - want) <= 0.01 * want + 1e-9);
+  }
+  // removing values that were never inserted changes nothing
+  QuantileSketch c;
+  c.insert(7);
+  c.remove(0);
+  c.remove(1000);
+  CHECK(c.count() == 1 && c.sum() == 7);
+  c.remove(7);
+  CHECK(c.count() == 0 && c.sum() == 0);
+}
+
+// the counter of layer l at i, and whether it is saturated
+static std::pair<uint64_t, bool> counter_at(const CM &m, size_t l, uint64_t i) {
+  std::pair<uint64_t, bool> r;
+  m.layers[l].visit([&](const auto &f, auto threshold) {
+    r = {f[i & m.layers[l].mask], f[i & m.layers[l].mask] == threshold};
+  });
+  return r;
+}
+
+TEST(masked_sum_and_mean_match_counter_walk) {
+  FilterConfig conf = {3, {{1, 12}, {8, 11}, {16, 10}}};
+  CM m(conf), mask(conf);
+  auto p = skewed_points(30000, 400);
+  m.put_all(p);
+  mask.put_all(random_points(500, 400));
+  uint64_t want = 0;
+  for (uint64_t i = 0; i < m.layers[0].size; i++) {
+    if (counter_at(mask, 0, i).first == 0)
+      continue;
+    for (size_t l = 0; l < m.layers.size(); l++) {
+      auto c = counter_at(m, l, i);
+      want += c.first;
+      if (!c.second)
+        break;
+    }
+  }
+  CHECK(m.get_sum_masked(mask) == want / mask.hashcount);
+  for (size_t i = 0; i < 400; i += 2) {
+    uint64_t h1 = H1, h2 = H2, sum = 0;
+    bool zero = false;
+    hash(&p[i], 2, &h1, &h2);
+    for (uint64_t k = 0; k < m.hashcount && !zero; k++)
+      for (size_t l = 0; l < m.layers.size(); l++) {
+        auto c = counter_at(m, l, h1 + (k + 1) * h2);
+        zero = c.first == 0;
+        sum += c.first;
+        if (zero || !c.second)
+          break;
+      }
+    CHECK(m.get_mean<double>({p[i], p[i + 1]}) ==
+          (zero ? 0.0 : (double)sum / (double)m.hashcount));
+  }
+}
+
+int main() {
+  int failed = 0;
+  for (auto &t : tests()) {
+    test_failed = false;
+    t.second();
+    std::cout << (test_failed ? "FAIL " : "ok   ") << t.first << std::endl;
+    failed += test_failed;
+  }
+  return failed;
+}